@@ -0,0 +1,30 @@
+#!/bin/sh
+# Starts the same env two ways and times each through bench/run.sh: by
+# loading a generated library of 30000 functions and 30000 data bindings
+# from source, and with --image from an image saved after loading it.
+# bench/startup.lspy then runs on top of either and both have to print
+# bench/startup.out.
+#
+#   bench/image.sh <lispy> [flags...]
+lispy=$1
+shift
+dir=$(dirname "$0")
+tmp=${TMPDIR:-/tmp}/lispy-bench-image.$$
+status=0
+
+awk 'BEGIN {
+  for (i = 0; i < 30000; i++) {
+    printf "(def {f%d} (\\ {x & r} {if (== x 0) {\"f%d\"} {join (list x %d.5 \"f%d\") {a (b c)} r}}))\n", i, i, i, i
+    printf "(def {d%d} {%d %d.25 \"s%d\" {k %d} (+ 1 2)})\n", i, i, i, i, i
+  }
+}' > "$tmp.lspy"
+printf '(save-image "%s")\n' "$tmp.img" |
+  "$lispy" "$@" "$tmp.lspy" "$dir/../tests/prelude.lspy" "$dir/prelude.lspy" > /dev/null
+
+printf 'source '
+sh "$dir/run.sh" "$lispy" "$dir/startup.lspy" "$@" "$tmp.lspy" || status=1
+printf 'image '
+sh "$dir/run.sh" "$lispy" "$dir/startup.lspy" "$@" --image "$tmp.img" || status=1
+
+rm -f "$tmp.lspy" "$tmp.img"
+exit $status
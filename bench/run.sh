@@ -0,0 +1,21 @@
+#!/bin/sh
+# Runs a bench script after the test prelude and the bench helpers in
+# bench/prelude.lspy and prints how long it took, then checks its output
+# against the .out next to it like a test case.
+#
+#   bench/run.sh <lispy> <bench.lspy> [flags...]
+lispy=$1
+case=$2
+shift 2
+dir=$(dirname "$0")
+tmp=${TMPDIR:-/tmp}/lispy-bench.$$
+
+start=$(date +%s%N)
+"$lispy" "$@" "$dir/../tests/prelude.lspy" "$dir/prelude.lspy" < "$case" > "$tmp"
+end=$(date +%s%N)
+echo "$(basename "$case" .lspy): $(( (end - start) / 1000000 ))ms"
+
+sed 's/^\(lispy> \)*//' "$tmp" | diff -u "${case%.lspy}.out" -
+status=$?
+rm -f "$tmp"
+exit $status
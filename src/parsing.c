@@ -1,9 +1,23 @@
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <math.h>
 #include <editline/readline.h>
 #include <errno.h>
+#include <limits.h>
 #include <assert.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+/* AVX2 code is built with a target attribute and chosen at run time */
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define LAVX2 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "mpc.h"
 
 mpc_parser_t* ParserNumber;
@@ -18,17 +32,42 @@ mpc_parser_t* ParserLispy;
 
 struct lval_s;
 struct lenv_s;
+struct lcode_s;
+struct lvnode_s;
+struct lhnode_s;
+struct lnums_s;
+struct lbig_s;
 typedef struct lval_s lval;
 typedef struct lenv_s lenv;
+typedef struct lcode_s lcode;
+typedef struct lvnode_s lvnode;
+typedef struct lhnode_s lhnode;
+typedef struct lnums_s lnums;
+typedef struct lbig_s lbig;
 
 typedef lval*(*lbuiltin) (lenv*, lval*);
 
-enum { LVAL_NUM, LVAL_ERR, LVAL_FNUM, LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR, LVAL_FUNC, LVAL_BOOL, LVAL_STR};
+/* a shared byte buffer: a file mapped into memory, or a heap buffer that
+ * strings are joined into. Strings pointing into it keep it alive */
+typedef struct {
+  int ref;
+  char *data;
+  size_t len;
+  /* heap buffers only, bytes written so far. A join appends after them */
+  size_t used;
+  int heap;
+} lmap;
+
+enum { LVAL_NUM, LVAL_ERR, LVAL_FNUM, LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR, LVAL_FUNC, LVAL_BOOL, LVAL_STR, LVAL_VEC, LVAL_MAP, LVAL_NUMS, LVAL_BIG};
 enum { LERR_DIV_ZERO, LERR_BAD_OP, LERR_BAD_NUM, LERR_INVALID_OP_FMOD };
+/* object header flags, a cleared slot is a free one. Static objects live
+ * outside the pools and are never collected */
+enum { LGC_LIVE = 1, LGC_MARK = 2, LGC_STATIC = 4 };
 
-#define EXTRACT_NUM(x) (long)((x)->type == LVAL_NUM ? (x)->num : (x)->fnum)
-#define EXTRACT_FNUM(x) (double)((x)->type == LVAL_NUM ? (x)->num : (x)->fnum)
-#define EXTRACT_VALUE(x) ((x)->type == LVAL_NUM ? (x)->num : (x)->fnum)
+#define EXTRACT_NUM(x) ((x)->type == LVAL_NUM ? (x)->num : (long)EXTRACT_FNUM(x))
+#define EXTRACT_FNUM(x) ((x)->type == LVAL_NUM ? (double)(x)->num : (x)->type == LVAL_BIG ? lbig_double(x) : (x)->fnum)
+#define EXTRACT_VALUE(x) EXTRACT_FNUM(x)
+#define LVAL_IS_NUMBER(x) ((x)->type == LVAL_NUM || (x)->type == LVAL_FNUM || (x)->type == LVAL_BIG)
 
 #define LASSERT(args, cond, fmt, ...)                               \
   if (!(cond)) { lval* err = lval_err((fmt), ##__VA_ARGS__); lval_del((args)); return err; }
@@ -42,83 +81,837 @@ enum { LERR_DIV_ZERO, LERR_BAD_OP, LERR_BAD_NUM, LERR_INVALID_OP_FMOD };
           "Got %s, Expected %s.", (op), index, ltype_name((args)->cell[(index)]->type), ltype_name((typ)));
 
 #define LASSERT_TYPE_NUMBER(op, args, index)                                                 \
-  LASSERT((args), LVAL_FNUM == (args)->cell[index]->type || LVAL_NUM == (args)->cell[index]->type, \
+  LASSERT((args), LVAL_IS_NUMBER((args)->cell[index]),                                      \
           "'%s' passed incorrect type for argument %i. "                          \
           "Got %s, Expected Number.", (op), index, ltype_name((args)->cell[(index)]->type));
 
+#define LASSERT_TYPE_LIST(op, args, index)                                                 \
+  LASSERT((args), LVAL_QEXPR == (args)->cell[index]->type || LVAL_VEC == (args)->cell[index]->type, \
+          "'%s' passed incorrect type for argument %i. "                          \
+          "Got %s, Expected Q-Expression or Vector.", (op), index, ltype_name((args)->cell[(index)]->type));
+
+#define LASSERT_KEY(op, args, index)                                                 \
+  LASSERT((args), lval_hashable((args)->cell[index]),                                      \
+          "'%s' passed incorrect type for argument %i. "                          \
+          "Got %s, Expected string, Symbol or Number.", (op), index, ltype_name((args)->cell[(index)]->type));
+
 #define LASSERT_EMPTY(op, args) LASSERT((args), (args)->count != 0, "'%s' passed {}!", (op));
 
 
+/* A small header followed by the members of the value's type. Only those
+ * are allocated, every type has a size class of its own, see
+ * lval_pools. */
 struct lval_s {
   int type;
+  int ref;
+  unsigned char gc;
+  /* lval pool the value came from */
+  unsigned char pool;
   union {
     long num;
     double fnum;
     lbuiltin func;
+    char *err;
+    /* symbol or string */
+    char *sym;
+    lval **cell;
+    lvnode *root;
+    lhnode *hroot;
+    lnums *nums;
+    lbig *big;
+  };
+  union {
+    /* lexical address hint of a symbol, slot 0 means unresolved */
+    struct {
+      int depth;
+      int slot;
+    };
+    /* length of a string, which may hold any byte. A string may be a
+     * slice of a mapped file, raw until first unescaped */
+    struct {
+      lmap *map;
+      int raw;
+      int slen;
+    };
+    /* lambda, func is NULL */
+    struct {
+      lenv* env;
+      lval* formals;
+      lval* body;
+    };
+    /* cell is a window of count values into an lcells buffer, off
+     * slots past its start. A vector is count values from index off of
+     * the trie at root, a map count pairs under hroot, a numeric array
+     * count elements of nums */
+    struct {
+      int count;
+      int off;
+      /* bytecode compiled from this list, dropped whenever it changes */
+      lcode *code;
+    };
+  };
+};
+
+/* Cells of Q and S-Expressions live in a reference counted buffer that
+ * lists share, so tail, init and popping the front only move a list's
+ * window. The buffer holds a reference to each value in [lo, hi), which
+ * covers every window onto it. Before changing its cells a list makes the
+ * buffer its own, see lval_cells_own. */
+typedef struct {
+  int ref;
+  int lo;
+  int hi;
+  int cap;
+  /* collection that last marked the buffer */
+  long mark;
+  lval *items[];
+} lcells;
+
+/* Vectors are persistent 32-way tries. Changing one copies the nodes on
+ * the path to the slot and shares all others, a path that only the vector
+ * being changed can reach is updated in place. */
+#define LVEC_BITS 5
+#define LVEC_WIDTH (1 << LVEC_BITS)
+#define LVEC_MASK (LVEC_WIDTH - 1)
+
+struct lvnode_s {
+  int ref;
+  /* 0 for leaves, which hold the values */
+  int shift;
+  /* collection that last marked the node */
+  long mark;
+  union {
+    lvnode *kids[LVEC_WIDTH];
+    lval *vals[LVEC_WIDTH];
   };
+};
 
-  lenv* env;
-  lval* formals;
-  lval* body;
+/* Maps are persistent hash array mapped tries, updated like vectors.
+ * Each level takes the next LMAP_BITS of a key's hash, a node keeps one
+ * slot per fragment in use: a pair, or a node below it when several keys
+ * share the fragment. Keys still colliding once the hash runs out share a
+ * node that is searched linearly. */
+#define LMAP_BITS 5
+#define LMAP_MASK ((1 << LMAP_BITS) - 1)
+#define LHASH_BITS (8 * (int)sizeof(unsigned long))
+
+typedef struct {
+  /* NULL when the slot holds a node */
+  lval *key;
+  union {
+    lval *val;
+    lhnode *node;
+  };
+} lhslot;
 
-  char *err;
-  char *sym;
+struct lhnode_s {
+  int ref;
   int count;
-  lval **cell;
+  /* one bit for each hash fragment with a slot */
+  unsigned bitmap;
+  /* collection that last marked the node */
+  long mark;
+  lhslot slots[];
+};
+
+/* Numeric arrays keep their elements unboxed and contiguous, all longs or
+ * all doubles, so the kernels that work on them run over plain memory.
+ * Copies share the buffer, which is never changed once filled. */
+struct lnums_s {
+  int ref;
+  /* elements are doubles rather than longs */
+  int flt;
+  long len;
+  long ints[];
+};
+
+#define lnums_flts(n) ((double*)(n)->ints)
+
+/* Integers too big for a long are bignums: a sign and a magnitude in 32
+ * bit limbs, lowest first, the top one never 0. A result that fits a long
+ * again is a plain number, so each integer has one representation. Like
+ * numeric arrays, copies share limbs that never change once computed. */
+struct lbig_s {
+  int ref;
+  int neg;
+  /* limbs in use and allocated */
+  int len;
+  int cap;
+  unsigned d[];
 };
 
+/* operands at least this many limbs long are multiplied by Karatsuba */
+#define LBIG_KARATSUBA 40
+/* results are refused past this many limbs, 64MB */
+#define LBIG_MAX_LIMBS (1 << 24)
+
+/* environments are reference counted like values, a frame holds a
+ * reference to its parent */
 struct lenv_s {
-  int count;
   lenv *parent;
+  int count;
+  unsigned char gc;
+  int ref;
+  int cap;
   char** syms;
   lval** vals;
+  /* open addressing index into syms/vals, only for big scopes */
+  int *index;
+  int index_cap;
+};
+
+/* scopes with fewer bindings are scanned linearly */
+#define LENV_INDEX_MIN 16
+
+/* Bytecode for one S-Expression. Each instruction is an opcode in the low
+ * byte and an operand above it. Constants are borrowed from the list the
+ * code was compiled from, which owns the code and stays unchanged while
+ * the code exists. */
+enum { LOP_CONST, LOP_LOOKUP, LOP_APPLY };
+
+#define LOP(op, arg) ((unsigned)(op) | ((unsigned)(arg) << 8))
+
+struct lcode_s {
+  int count;
+  int cap;
+  unsigned *ins;
+  int nconsts;
+  int cconsts;
+  lval **consts;
+  int stack;
 };
 
+int lvm_enabled;
+/* read through the mpc grammar instead of the hand written reader */
+int lmpc_enabled;
+
+/* Single pass reader, goes from a byte buffer straight to lval without
+ * building a syntax tree. Accepts the same language as the mpc grammar
+ * in main. Reading from a file refills the buffer as it goes. */
+#define LREAD_CHUNK (64 * 1024)
+
+typedef struct {
+  const char *name;
+  const char *buf;
+  size_t pos;
+  size_t len;
+  FILE *f;
+  char *own;
+  size_t cap;
+  long line;
+  int row;
+  int forms;
+  int comments;
+  lmap *map;
+} lreader;
+
 lval *lval_eval(lenv *e, lval *);
 lval *lval_copy(lval *);
+void lval_del(lval *v);
+lval *lval_eval_sexpr(lenv *e, lval *v);
+lval *lval_apply(lenv *e, lval *v);
 lenv* lenv_new(void);
 void lenv_del(lenv *e);
-lenv* lenv_copy(lenv *e);
 lval* builtin_eval(lenv* e, lval *a);
 lval* builtin_list(lenv* e, lval *a);
+char* lbuiltin_name(lbuiltin func);
+lbuiltin lbuiltin_find(const char *name);
 void lval_expr_print(lval *v, char open, char close);
+void lval_vec_print(lval *v);
+lval *lvec_get(lval *v, int i);
+void lval_map_print(lval *v);
+void lval_nums_print(lval *v);
+void lhnode_list(lhnode *n, lval *q, int vals);
+int lval_eq(lval *x, lval *y);
+double lbig_double(lval *v);
+lval* lval_read_big(const char *s);
+void lval_big_print(lval *v);
+
+/* slab allocator: fixed-size slots carved out of big chunks and recycled
+ * through a free list, one pool per size class */
+#define LSLAB_BYTES (64 * 1024)
+#define LALLOC_MAX 1024
+
+typedef struct lslab_s {
+  struct lslab_s *next;
+  size_t nslots;
+  char data[];
+} lslab;
+
+typedef struct {
+  size_t size;
+  void *free;
+  lslab *slabs;
+  long allocs;
+  long frees;
+} lpool;
+
+/* bump arena for scratch buffers, reset wholesale after every top level
+ * evaluation */
+typedef struct larena_block_s {
+  struct larena_block_s *next;
+  size_t size;
+  size_t used;
+  char data[];
+} larena_block;
+
+typedef struct {
+  larena_block *head;
+  size_t high;
+} larena;
+
+typedef struct {
+  larena_block *block;
+  size_t used;
+} larena_mark;
+
+static const size_t lalloc_sizes[] = { 16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024 };
+#define LALLOC_CLASSES (sizeof(lalloc_sizes) / sizeof(lalloc_sizes[0]))
+
+/* lval size classes: numbers, bools, errors and builtins; symbols;
+ * strings and lists; lambdas */
+enum { LPOOL_SCALAR, LPOOL_SYM, LPOOL_SEQ, LPOOL_LAMBDA, LPOOL_COUNT };
+
+#define LVAL_END(member) (offsetof(lval, member) + sizeof(((lval*)0)->member))
+
+lpool lval_pools[LPOOL_COUNT] = {
+  { LVAL_END(num) },
+  { LVAL_END(slot) },
+  { LVAL_END(code) > LVAL_END(slen) ? LVAL_END(code) : LVAL_END(slen) },
+  { LVAL_END(body) },
+};
+lpool lenv_pool = { sizeof(lenv) };
+lpool lalloc_pools[LALLOC_CLASSES];
+unsigned char lalloc_class[LALLOC_MAX / 16 + 1];
+long lalloc_large_allocs;
+long lalloc_large_frees;
+long lalloc_slab_bytes;
+larena scratch;
+
+void
+lalloc_init(void)
+{
+  int c = 0;
+  for (int i = 0; i <= LALLOC_MAX / 16; i++) {
+    while (lalloc_sizes[c] < i * 16) {
+      c++;
+    }
+    lalloc_class[i] = c;
+  }
+  for (int i = 0; i < LALLOC_CLASSES; i++) {
+    lalloc_pools[i].size = lalloc_sizes[i];
+  }
+}
+
+void
+lpool_grow(lpool *p)
+{
+  size_t size = p->size < sizeof(void*) ? sizeof(void*) : p->size;
+  size_t n = (LSLAB_BYTES - sizeof(lslab)) / size;
+  /* zeroed, so the collector sees every fresh slot as free */
+  lslab *s = calloc(1, sizeof(lslab) + n * size);
+  s->nslots = n;
+  s->next = p->slabs;
+  p->slabs = s;
+  lalloc_slab_bytes += sizeof(lslab) + n * size;
+
+  /* thread the new slots onto the free list, lowest address first */
+  for (size_t i = n; i-- > 0; ) {
+    void *x = s->data + i * size;
+    *(void**)x = p->free;
+    p->free = x;
+  }
+}
+
+static inline void*
+lpool_alloc(lpool *p)
+{
+  if (!p->free) {
+    lpool_grow(p);
+  }
+  void *x = p->free;
+  p->free = *(void**)x;
+  p->allocs++;
+  return x;
+}
+
+static inline void
+lpool_free(lpool *p, void *x)
+{
+  *(void**)x = p->free;
+  p->free = x;
+  p->frees++;
+}
+
+void*
+lalloc(size_t size)
+{
+  if (size == 0) {
+    return NULL;
+  }
+  if (size > LALLOC_MAX) {
+    lalloc_large_allocs++;
+    return malloc(size);
+  }
+  return lpool_alloc(&lalloc_pools[lalloc_class[(size + 15) / 16]]);
+}
+
+void
+lfree(void *x, size_t size)
+{
+  if (!x) {
+    return;
+  }
+  if (size > LALLOC_MAX) {
+    lalloc_large_frees++;
+    free(x);
+    return;
+  }
+  lpool_free(&lalloc_pools[lalloc_class[(size + 15) / 16]], x);
+}
+
+void*
+lrealloc(void *x, size_t old, size_t size)
+{
+  if (old > LALLOC_MAX && size > LALLOC_MAX) {
+    return realloc(x, size);
+  }
+  /* same size class, nothing to move */
+  if (x && size && old <= LALLOC_MAX && size <= LALLOC_MAX
+      && lalloc_class[(old + 15) / 16] == lalloc_class[(size + 15) / 16]) {
+    return x;
+  }
+  void *n = lalloc(size);
+  if (x && n) {
+    memcpy(n, x, old < size ? old : size);
+  }
+  lfree(x, old);
+  return n;
+}
+
+char*
+lstrdup(const char *s)
+{
+  size_t n = strlen(s) + 1;
+  char *x = lalloc(n);
+  memcpy(x, s, n);
+  return x;
+}
+
+static inline void
+lstrfree(char *s)
+{
+  lfree(s, strlen(s) + 1);
+}
+
+/* copies n bytes which may include NULs, terminated for convenience */
+char*
+lstrndup(const char *s, size_t n)
+{
+  char *x = lalloc(n + 1);
+  memcpy(x, s, n);
+  x[n] = 0;
+  return x;
+}
+
+void*
+larena_alloc(larena *a, size_t size)
+{
+  size = (size + 15) & ~(size_t)15;
+  if (!a->head || a->head->used + size > a->head->size) {
+    size_t bytes = size > LSLAB_BYTES ? size : LSLAB_BYTES;
+    larena_block *b = malloc(sizeof(larena_block) + bytes);
+    b->size = bytes;
+    b->used = 0;
+    b->next = a->head;
+    a->head = b;
+  }
+  void *x = a->head->data + a->head->used;
+  a->head->used += size;
+  return x;
+}
+
+static inline larena_mark
+larena_save(larena *a)
+{
+  larena_mark m = { a->head, a->head ? a->head->used : 0 };
+  return m;
+}
+
+/* drop everything allocated since the mark */
+void
+larena_restore(larena *a, larena_mark m)
+{
+  size_t total = 0;
+  for (larena_block *b = a->head; b; b = b->next) {
+    total += b->used;
+  }
+  if (total > a->high) {
+    a->high = total;
+  }
+
+  while (a->head != m.block) {
+    larena_block *b = a->head;
+    a->head = b->next;
+    free(b);
+  }
+  if (a->head) {
+    a->head->used = m.used;
+  }
+}
+
+/* release everything allocated from the arena, keeping one block around */
+void
+larena_reset(larena *a)
+{
+  larena_block *last = a->head;
+  while (last && last->next) {
+    last = last->next;
+  }
+  larena_mark m = { last, 0 };
+  larena_restore(a, m);
+}
+
+/* symbol table: every symbol name is stored once, so symbols can be
+ * compared and hashed by pointer */
+typedef struct {
+  char **slots;
+  size_t cap;
+  size_t count;
+  long bytes;
+} lsymtab;
+
+lsymtab symtab;
+char *lsym_amp;
+
+static inline unsigned long
+lsym_hash(const char *s, size_t len)
+{
+  unsigned long h = 14695981039346656037UL;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)s[i]) * 1099511628211UL;
+  }
+  return h;
+}
+
+void
+lsymtab_grow(lsymtab *t)
+{
+  size_t cap = t->cap ? t->cap * 2 : 256;
+  char **slots = calloc(cap, sizeof(char*));
+  for (size_t i = 0; i < t->cap; i++) {
+    if (!t->slots[i]) {
+      continue;
+    }
+    size_t j = lsym_hash(t->slots[i], strlen(t->slots[i])) & (cap - 1);
+    while (slots[j]) {
+      j = (j + 1) & (cap - 1);
+    }
+    slots[j] = t->slots[i];
+  }
+  free(t->slots);
+  t->slots = slots;
+  t->cap = cap;
+}
+
+char*
+lsym_intern_len(const char *s, size_t len)
+{
+  if (symtab.count * 2 >= symtab.cap) {
+    lsymtab_grow(&symtab);
+  }
+
+  size_t i = lsym_hash(s, len) & (symtab.cap - 1);
+  while (symtab.slots[i]) {
+    if (strncmp(symtab.slots[i], s, len) == 0 && symtab.slots[i][len] == 0) {
+      return symtab.slots[i];
+    }
+    i = (i + 1) & (symtab.cap - 1);
+  }
+
+  char *x = malloc(len + 1);
+  memcpy(x, s, len);
+  x[len] = 0;
+  symtab.slots[i] = x;
+  symtab.count++;
+  symtab.bytes += len + 1;
+  return x;
+}
+
+static inline char*
+lsym_intern(const char *s)
+{
+  return lsym_intern_len(s, strlen(s));
+}
 
+lmap*
+lmap_open(const char *name)
+{
+  int fd = open(name, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  /* private and writable, strings are unescaped in place */
+  char *data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return NULL;
+  }
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+  lmap *m = malloc(sizeof(lmap));
+  m->ref = 1;
+  m->data = data;
+  m->len = st.st_size;
+  m->used = 0;
+  m->heap = 0;
+  return m;
+}
+
+/* heap buffer for len bytes, with room for a NUL after them */
+lmap*
+lmap_new(char *data, size_t len)
+{
+  lmap *m = malloc(sizeof(lmap));
+  m->ref = 1;
+  m->data = data ? data : lalloc(len + 1);
+  m->len = len;
+  m->used = 0;
+  m->heap = 1;
+  return m;
+}
+
+static inline lmap*
+lmap_ref(lmap *m)
+{
+  m->ref++;
+  return m;
+}
+
+void
+lmap_del(lmap *m)
+{
+  if (--m->ref > 0) {
+    return;
+  }
+  if (m->heap) {
+    lfree(m->data, m->len + 1);
+  } else {
+    munmap(m->data, m->len);
+  }
+  free(m);
+}
+
+/* escape sequences of strings, the same as mpc's. The trailing NUL of
+ * lstr_chars is the character of \0 */
+static const char lstr_escapes[] = "abfnrtv\\'\"0";
+static const char lstr_chars[] = "\a\b\f\n\r\t\v\\'\"";
+
+/* unescapes the same sequences as mpcf_unescape, others are kept as is.
+ * dst may be src, returns the length written */
+size_t
+lstr_unescape(char *dst, const char *src, size_t len)
+{
+  char *o = dst;
+  const char *end = src + len;
+  for (const char *i = src; i < end; i++) {
+    const char *esc;
+    if (*i == '\\' && i + 1 < end && (esc = memchr(lstr_escapes, i[1], sizeof(lstr_escapes) - 1))) {
+      *o++ = lstr_chars[esc - lstr_escapes];
+      i++;
+    } else {
+      *o++ = *i;
+    }
+  }
+  return o - dst;
+}
+
+/* contents of a string, a slice of a mapped file is unescaped in place the
+ * first time it is used */
+char*
+lstr(lval *v)
+{
+  if (v->raw) {
+    v->slen = lstr_unescape(v->sym, v->sym, v->slen);
+    v->sym[v->slen] = 0;
+    v->raw = 0;
+  }
+  return v->sym;
+}
+
+/* contents of a string as a C string. A view that runs into the bytes
+ * after it gets a copy of its own */
+char*
+lstr_cstr(lval *v)
+{
+  char *s = lstr(v);
+  if (s[v->slen]) {
+    v->sym = lstrndup(s, v->slen);
+    lmap_del(v->map);
+    v->map = NULL;
+  }
+  return v->sym;
+}
+
+/* Substring search after Wojciech Mula's SIMD friendly algorithm: a block
+ * of candidate positions is compared against the first and the last byte
+ * of the needle at once, only positions matching both are memcmp'd. SSE2
+ * is part of x86-64, AVX2 is picked at run time where the CPU has it. */
+static inline long
+lstr_find_scalar(const char *h, size_t hlen, const char *n, size_t nlen, size_t i)
+{
+  for (; i + nlen <= hlen; i++) {
+    if (h[i] == n[0] && h[i + nlen - 1] == n[nlen - 1] && memcmp(h + i, n, nlen) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+#ifdef __SSE2__
+static long
+lstr_find_sse2(const char *h, size_t hlen, const char *n, size_t nlen)
+{
+  __m128i first = _mm_set1_epi8(n[0]);
+  __m128i last = _mm_set1_epi8(n[nlen - 1]);
+  size_t i = 0;
+  for (; i + nlen - 1 + 16 <= hlen; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(h + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(h + i + nlen - 1));
+    unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (mask) {
+      int k = __builtin_ctz(mask);
+      if (memcmp(h + i + k, n, nlen) == 0) {
+        return i + k;
+      }
+      mask &= mask - 1;
+    }
+  }
+  return lstr_find_scalar(h, hlen, n, nlen, i);
+}
+#endif
+
+#ifdef LAVX2
+__attribute__((target("avx2")))
+static long
+lstr_find_avx2(const char *h, size_t hlen, const char *n, size_t nlen)
+{
+  __m256i first = _mm256_set1_epi8(n[0]);
+  __m256i last = _mm256_set1_epi8(n[nlen - 1]);
+  size_t i = 0;
+  for (; i + nlen - 1 + 32 <= hlen; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(h + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(h + i + nlen - 1));
+    unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+    while (mask) {
+      int k = __builtin_ctz(mask);
+      if (memcmp(h + i + k, n, nlen) == 0) {
+        return i + k;
+      }
+      mask &= mask - 1;
+    }
+  }
+  return lstr_find_scalar(h, hlen, n, nlen, i);
+}
+#endif
+
+/* offset of the first n in h, -1 when there is none */
+long
+lstr_find(const char *h, size_t hlen, const char *n, size_t nlen)
+{
+  if (!nlen) {
+    return 0;
+  }
+  if (nlen > hlen) {
+    return -1;
+  }
+#ifdef LAVX2
+  if (__builtin_cpu_supports("avx2")) {
+    return lstr_find_avx2(h, hlen, n, nlen);
+  }
+#endif
+#ifdef __SSE2__
+  return lstr_find_sse2(h, hlen, n, nlen);
+#else
+  return lstr_find_scalar(h, hlen, n, nlen, 0);
+#endif
+}
+
+/* turns a string owning its bytes into a view of them, so copies and
+ * slices can share them */
+void
+lstr_share(lval *v)
+{
+  lstr(v);
+  if (!v->map) {
+    v->map = lmap_new(v->sym, v->slen);
+    v->map->used = v->slen;
+  }
+}
 
 lval*
-new_lval()
+new_lval(int pool)
 {
-  lval* v = malloc(sizeof(lval));
-  bzero(v, sizeof(lval));
+  lval* v = lpool_alloc(&lval_pools[pool]);
+  bzero(v, lval_pools[pool].size);
+  v->ref = 1;
+  v->gc = LGC_LIVE;
+  v->pool = pool;
+  return v;
+}
+
+/* values are reference counted and never mutated once shared: lval_ref
+ * hands out another reference, lval_del drops one, and anything about to
+ * modify a value in place has to lval_own it first */
+static inline lval*
+lval_ref(lval *v)
+{
+  v->ref++;
   return v;
 }
 
 lval*
 lval_func(lbuiltin func)
 {
-  lval* v = new_lval();
+  lval* v = new_lval(LPOOL_SCALAR);
   v->type = LVAL_FUNC;
   v->func = func;
   return v;
 }
 
 lval*
-lval_str(char *str)
+lval_str_len(const char *str, size_t len)
 {
-  lval* v = new_lval();
+  lval* v = new_lval(LPOOL_SEQ);
   v->type = LVAL_STR;  
-  v->sym = malloc(strlen(str) + 1);
-  strcpy(v->sym, str);
+  v->sym = lstrndup(str, len);
+  v->slen = len;
   return v;
 }
 
+lval*
+lval_str(char *str)
+{
+  return lval_str_len(str, strlen(str));
+}
+
+/* strings shorter than this are copied rather than shared, a short slice
+ * should not keep a big buffer alive */
+#define LSTR_SHARE_MIN 32
+
 lval*
 lval_lambda(lval* formals, lval* body)
 {
-  lval* v= new_lval();
+  lval* v= new_lval(LPOOL_LAMBDA);
   v->type = LVAL_FUNC;
   v->func = NULL;
 
-  v->env = lenv_new();
+  v->env = NULL;
   v->formals = formals;
   v->body = body;
   return v;
@@ -127,17 +920,49 @@ lval_lambda(lval* formals, lval* body)
 lval*
 lval_qexpr(void)
 {
-  lval* v = new_lval();
+  lval* v = new_lval(LPOOL_SEQ);
   v->type = LVAL_QEXPR;
   v->count = 0;
   v->cell = NULL;
   return v;
 }
 
+/* Small integers and both bools are preallocated and shared, making one
+ * costs a reference count bump instead of an allocation. Their count
+ * starts far above anything a program reaches, so lval_own copies them
+ * before any change and lval_del never frees them. */
+#define LSMALL_MIN -128
+#define LSMALL_MAX 1023
+#define LSTATIC_REF (1 << 30)
+
+lval lsmall[LSMALL_MAX - LSMALL_MIN + 1];
+lval lbools[2];
+
+void
+lval_init_static(void)
+{
+  for (long i = LSMALL_MIN; i <= LSMALL_MAX; i++) {
+    lval *v = &lsmall[i - LSMALL_MIN];
+    v->type = LVAL_NUM;
+    v->num = i;
+    v->ref = LSTATIC_REF;
+    v->gc = LGC_LIVE | LGC_STATIC;
+  }
+  for (int i = 0; i < 2; i++) {
+    lbools[i].type = LVAL_BOOL;
+    lbools[i].num = i;
+    lbools[i].ref = LSTATIC_REF;
+    lbools[i].gc = LGC_LIVE | LGC_STATIC;
+  }
+}
+
 lval*
 lval_num(long x)
 {
-  lval* v = new_lval();
+  if (x >= LSMALL_MIN && x <= LSMALL_MAX) {
+    return lval_ref(&lsmall[x - LSMALL_MIN]);
+  }
+  lval* v = new_lval(LPOOL_SCALAR);
   v->type = LVAL_NUM;
   v->num = x;
   return v;
@@ -146,16 +971,13 @@ lval_num(long x)
 lval*
 lval_bool(int x)
 {
-  lval* v = new_lval();
-  v->type = LVAL_BOOL;
-  v->num = x;
-  return v;
+  return lval_ref(&lbools[x != 0]);
 }
 
 lval*
 lval_fnum(double x)
 {
-  lval* v = new_lval();
+  lval* v = new_lval(LPOOL_SCALAR);
   v->type = LVAL_FNUM;
   v->fnum = x;
   return v;
@@ -164,14 +986,16 @@ lval_fnum(double x)
 lval*
 lval_err(char *fmt, ...)
 {
-  lval* v = new_lval();
+  lval* v = new_lval(LPOOL_SCALAR);
   v->type = LVAL_ERR;
   va_list va;
   va_start(va, fmt);
 
-  v->err = malloc(512);
-  vsnprintf(v->err, 511, fmt, va);
-  v->err = realloc(v->err, strlen(v->err) + 1);
+  larena_mark m = larena_save(&scratch);
+  char *buf = larena_alloc(&scratch, 512);
+  vsnprintf(buf, 511, fmt, va);
+  v->err = lstrdup(buf);
+  larena_restore(&scratch, m);
   
   va_end(va);
   return v;
@@ -180,17 +1004,16 @@ lval_err(char *fmt, ...)
 lval*
 lval_sym(char *s)
 {
-  lval *v = new_lval();
+  lval *v = new_lval(LPOOL_SYM);
   v->type = LVAL_SYM;
-  v->sym = malloc(strlen(s)+1);
-  strcpy(v->sym, s);
+  v->sym = lsym_intern(s);
   return v;
 }
 
 lval*
 lval_sexpr(void)
 {
-  lval* v = new_lval();
+  lval* v = new_lval(LPOOL_SEQ);
   v->type = LVAL_SEXPR;
   v->count = 0;
   v->cell = NULL;
@@ -198,976 +1021,4724 @@ lval_sexpr(void)
 }
 
 void
-lval_del(lval *v)
+lcode_del(lcode *c)
 {
-  switch (v->type) {
-  case LVAL_STR:
-    free(v->sym);
-    break;
-  case  LVAL_FUNC:
-    if (!v->func) {
-      lenv_del(v->env);
-      lval_del(v->formals);
-      lval_del(v->body);
-    }
-    break;
-  case LVAL_NUM:
-  case LVAL_FNUM:
-    break;
-  case LVAL_SYM:
-    free(v->sym);
-    break;
-  case LVAL_ERR:
-    free(v->err);
-    break;
-  case LVAL_SEXPR:
-  case LVAL_QEXPR:
-    for (int i = 0; i < v->count; i++) {
-      lval_del(v->cell[i]);
-    }
-    free(v->cell);
-    break;
-  };
-  free(v);
-  return;
+  lfree(c->ins, sizeof(unsigned) * c->cap);
+  lfree(c->consts, sizeof(lval*) * c->cconsts);
+  lfree(c, sizeof(lcode));
 }
 
-lval*
-lval_read_num(mpc_ast_t *t)
+static inline void
+lval_uncache(lval *v)
 {
-  errno = 0;
-  long x = strtol(t->contents, NULL, 10);
-  return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
+  if (v->code) {
+    lcode_del(v->code);
+    v->code = NULL;
+  }
 }
 
-lval*
-lval_read_fnum(mpc_ast_t *t)
+static inline lcells*
+lval_cells(lval *v)
 {
-  errno = 0;
-  long x = strtod(t->contents, NULL);
-  return errno != ERANGE ? lval_fnum(x) : lval_err("invalid number");  
+  return (lcells*)((char*)(v->cell - v->off) - offsetof(lcells, items));
 }
 
-lval*
-lval_add(lval *v, lval *x)
+lcells*
+lcells_new(int cap)
 {
-  v->count++;
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-  v->cell[v->count-1] = x;
-  return v;
+  lcells *c = lalloc(sizeof(lcells) + sizeof(lval*) * cap);
+  c->ref = 1;
+  c->lo = 0;
+  c->hi = 0;
+  c->cap = cap;
+  c->mark = 0;
+  return c;
 }
 
-lval*
-lval_add_front(lval *v, lval *x)
+void
+lcells_del(lcells *c)
 {
-  v->count++;
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-  memmove(v->cell+1, v->cell, sizeof(lval*) * (v->count-1));
-  v->cell[0] = x;
-  return v;
-}
-
-lenv*
-lenv_new(void)
-{
-  lenv *e = malloc(sizeof(lenv));
-  e->parent = NULL;
-  e->count = 0;
-  e->syms = NULL;
-  e->vals = NULL;
-  return e;
-}
-
-void
-lenv_del(lenv *e)
-{
-  for (int i = 0; i < e->count; i++) {
-    free(e->syms[i]);
-    lval_del(e->vals[i]);
+  if (--c->ref > 0) {
+    return;
   }
-  free(e->syms);
-  free(e->vals);
-  free(e);
+  for (int i = c->lo; i < c->hi; i++) {
+    lval_del(c->items[i]);
+  }
+  lfree(c, sizeof(lcells) + sizeof(lval*) * c->cap);
 }
 
-lenv*
-lenv_copy(lenv *e)
+lvnode*
+lvnode_new(int shift)
 {
-  lenv *n = malloc(sizeof(lenv));
-  n->parent = e->parent;
-  n->count = e->count;
-  n->syms = malloc(sizeof(char*) * n->count);
-  n->vals = malloc(sizeof(lval*) * n->count);
-  for (int i = 0; i < n->count; i++) {
-    n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-    strcpy(n->syms[i], e->syms[i]);
-    n->vals[i] = lval_copy(e->vals[i]);
-  }
+  lvnode *n = lalloc(sizeof(lvnode));
+  bzero(n, sizeof(lvnode));
+  n->ref = 1;
+  n->shift = shift;
   return n;
 }
 
-lval*
-lenv_get(lenv *e, lval *k)
+void
+lvnode_del(lvnode *n)
 {
-  for (int i = 0; i < e->count; i++) {
-    if (strcmp(k->sym, e->syms[i]) == 0) {
-      return lval_copy(e->vals[i]);
-    }
+  if (!n || --n->ref > 0) {
+    return;
   }
-
-  if (e->parent) {
-    return lenv_get(e->parent, k);
+  for (int i = 0; i < LVEC_WIDTH; i++) {
+    if (n->shift) {
+      lvnode_del(n->kids[i]);
+    } else if (n->vals[i]) {
+      lval_del(n->vals[i]);
+    }
   }
-  
-  return lval_err("unbound symbol: %s", k->sym);
+  lfree(n, sizeof(lvnode));
 }
 
-/* define local variable */
-void
-lenv_put(lenv *e, lval *k, lval *v)
+lnums*
+lnums_new(long len, int flt)
 {
-  for (int i = 0; i < e->count; i++) {
-    if (strcmp(k->sym, e->syms[i]) == 0) {
-      lval_del(e->vals[i]);
-      e->vals[i] = lval_copy(v);
-      return;
-    }
-  }
-  e->count++;
-  e->vals = realloc(e->vals, sizeof(lval *) * e->count);
-  e->syms = realloc(e->syms, sizeof(char *) * e->count);
-
-  e->vals[e->count - 1] = lval_copy(v);
-  e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-  strcpy(e->syms[e->count - 1], k->sym);
+  lnums *n = lalloc(sizeof(lnums) + sizeof(long) * len);
+  n->ref = 1;
+  n->flt = flt;
+  n->len = len;
+  return n;
 }
 
-/* define global variable */
 void
-lenv_def(lenv *e, lval *k, lval *v)
+lnums_del(lnums *n)
 {
-  while (e->parent) {
-    e = e->parent;
+  if (--n->ref == 0) {
+    lfree(n, sizeof(lnums) + sizeof(long) * n->len);
   }
-  lenv_put(e, k, v);
 }
 
-lval*
-lval_read_str(mpc_ast_t* t)
+/* a zeroed magnitude of cap limbs */
+lbig*
+lbig_new(int cap)
 {
-  // remove quote characters 
-  t->contents[strlen(t->contents)-1] = 0;
-  char *unescaped = malloc(strlen(t->contents+1)+1);
-  strcpy(unescaped, t->contents+1);
-  unescaped = mpcf_unescape(unescaped);
-  lval* v = lval_str(unescaped);
-  free(unescaped);
-  return v;
-}
-
-lval*
-lval_read(mpc_ast_t *t) {
-  if (strstr(t->tag, "fnumber")) {
-    return lval_read_fnum(t);
-  }
-  
-  if (strstr(t->tag, "number")) {
-    return lval_read_num(t);
-  }
-
-  if (strstr(t->tag, "symbol")) {
-    return lval_sym(t->contents);
-  }
-
-  if (strstr(t->tag, "string")) {
-    return lval_read_str(t);
-  }
-
-  lval *x = NULL;
-  // root
-  if (strcmp(t->tag, ">") == 0 || strstr(t->tag, "sexpr")) {
-    x = lval_sexpr();
-  } else if (strstr(t->tag, "qexpr")) {
-    x = lval_qexpr();
-  }
-
-  for (int i = 0; i < t->children_num; i++) {
-    if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-    if (strcmp(t->children[i]->tag, "regex") == 0) { continue; }
-    if (strstr(t->children[i]->tag, "comment")) { continue; }
-    x = lval_add(x, lval_read(t->children[i]));
-  }
-  return x;
+  lbig *b = lalloc(sizeof(lbig) + sizeof(unsigned) * cap);
+  b->ref = 1;
+  b->neg = 0;
+  b->len = cap;
+  b->cap = cap;
+  bzero(b->d, sizeof(unsigned) * cap);
+  return b;
 }
 
-char*
-ltype_name(int t)
+void
+lbig_del(lbig *b)
 {
-  switch(t) {
-  case LVAL_STR: return "string";
-  case LVAL_FUNC: return "Function";
-  case LVAL_NUM:
-  case LVAL_FNUM:
-    return "Number";
-  case LVAL_ERR: return "Error";
-  case LVAL_SYM: return "Symbol";
-  case LVAL_SEXPR: return "S-Expression";
-  case LVAL_QEXPR: return "Q-Expression";
-  default: return "Unknown";
+  if (--b->ref == 0) {
+    lfree(b, sizeof(lbig) + sizeof(unsigned) * b->cap);
   }
 }
 
-lval*
-lval_tobool(lval *v)
+lhnode*
+lhnode_new(int count)
 {
-  int i = 0;
-  switch (v->type) {
-  case LVAL_STR:
-    i = strlen(v->sym);
-    break;
-  case LVAL_NUM:
-  case LVAL_FNUM:
-    i = EXTRACT_VALUE(v) != 0;
-    break;
-  case LVAL_QEXPR:
-  case LVAL_SEXPR:
-    i = v->count;
-    break;
-  case LVAL_SYM:
-    i = strlen(v->sym);
-    break;
-  case LVAL_BOOL:
-    return lval_copy(v);
-  default:
-    return lval_err("cannot convert %s to bool", ltype_name(v->type));
-  }
-  return lval_bool(i);
+  lhnode *n = lalloc(sizeof(lhnode) + sizeof(lhslot) * count);
+  n->ref = 1;
+  n->count = count;
+  n->bitmap = 0;
+  n->mark = 0;
+  return n;
 }
 
 void
-lval_print_str(lval *v)
+lhnode_del(lhnode *n)
 {
-  char *escaped = malloc(strlen(v->sym)+1);
-  strcpy(escaped, v->sym);
-  escaped = mpcf_escape(escaped);
-  printf("\"%s\"", escaped);
-  free(escaped);
+  if (!n || --n->ref > 0) {
+    return;
+  }
+  for (int i = 0; i < n->count; i++) {
+    if (n->slots[i].key) {
+      lval_del(n->slots[i].key);
+      lval_del(n->slots[i].val);
+    } else {
+      lhnode_del(n->slots[i].node);
+    }
+  }
+  lfree(n, sizeof(lhnode) + sizeof(lhslot) * n->count);
 }
 
 void
-lval_print(lval *v)
+lval_del(lval *v)
 {
+  if (--v->ref > 0) {
+    return;
+  }
+
   switch (v->type) {
   case LVAL_STR:
-    lval_print_str(v);
-    break;
-  case LVAL_BOOL: 
-    if (v->num) {
-      printf("<true>");
+    if (v->map) {
+      lmap_del(v->map);
     } else {
-      printf("<false>"); 
+      lfree(v->sym, v->slen + 1);
     }
     break;
-  case LVAL_FUNC:
-    if (v->func) {
-      printf("<builtin function>");
-    } else {
-      printf("(\\ "); lval_print(v->formals);
-      putchar(' '); lval_print(v->body); putchar(' ');
+  case  LVAL_FUNC:
+    if (!v->func) {
+      if (v->env) {
+        lenv_del(v->env);
+      }
+      lval_del(v->formals);
+      lval_del(v->body);
     }
     break;
   case LVAL_NUM:
-    printf("%li", v->num);
-    break;
   case LVAL_FNUM:
-    printf("%f", v->fnum);
-    break;
   case LVAL_SYM:
-    printf("%s", v->sym);
     break;
   case LVAL_ERR:
-    printf("Error: %s", v->err);
+    lstrfree(v->err);
     break;
   case LVAL_SEXPR:
-    lval_expr_print(v, '(', ')');
-    break;
   case LVAL_QEXPR:
-    lval_expr_print(v, '{', '}');
-    break;    
-  default:
-     break;    
-  }
-}
-
-lval*
-lval_copy(lval *v)
-{
-  lval *x = new_lval();
-  x->type = v->type;
-  switch (x->type) {
-  case LVAL_STR:
-    x->sym = malloc(strlen(v->sym) + 1);
-    strcpy(x->sym, v->sym);
-    break;
-  case LVAL_BOOL:
-    x->num = v->num;
-    break;
-  case LVAL_FUNC:
-    if (v->func) {
-      x->func = v->func;
-    } else {
-      x->env = lenv_copy(v->env);
-      x->formals = lval_copy(v->formals);
-      x->body = lval_copy(v->body);
+    if (v->cell) {
+      lcells_del(lval_cells(v));
     }
-
+    lval_uncache(v);
     break;
-  case LVAL_NUM: x->num = v->num; break;
-  case LVAL_FNUM: x->fnum = v->fnum; break;
-  case LVAL_ERR:
-    x->err = malloc(strlen(v->err) + 1);
-    strcpy(x->err, v->err);
+  case LVAL_VEC:
+    lvnode_del(v->root);
     break;
-  case LVAL_SYM:
-    x->sym = malloc(strlen(v->sym) + 1);
-    strcpy(x->sym, v->sym);
+  case LVAL_MAP:
+    lhnode_del(v->hroot);
     break;
-  case LVAL_QEXPR:
-  case LVAL_SEXPR:
-    x->count = v->count;
-    x->cell = malloc(sizeof(lval*)*v->count);
-    for (int i = 0; i < x->count; i++) {
-      x->cell[i] = lval_copy(v->cell[i]);
-    }
+  case LVAL_NUMS:
+    lnums_del(v->nums);
     break;
-  }
-  return x;
+  case LVAL_BIG:
+    lbig_del(v->big);
+    break;
+  };
+  v->gc = 0;
+  lpool_free(&lval_pools[v->pool], v);
+  return;
 }
 
-void
-lval_expr_print(lval *v, char open, char close)
+lval*
+lval_read_num(char *s)
 {
-  putchar(open);
-  for (int i = 0; i < v->count; i++) {
-    lval_print(v->cell[i]);
+  errno = 0;
+  long x = strtol(s, NULL, 10);
+  return errno != ERANGE ? lval_num(x) : lval_read_big(s);
+}
 
-    if (i != v->count - 1) {
-      putchar(' ');
-    }
+lval*
+lval_read_fnum(char *s)
+{
+  errno = 0;
+  double x = strtod(s, NULL);
+  return errno != ERANGE ? lval_fnum(x) : lval_err("invalid number");  
+}
+
+void lval_cells_move(lval *v, int front, int back);
+
+/* makes the cells of v safe to change in place: a shared buffer is
+ * copied, an unshared one loses whatever lies outside the window */
+void
+lval_cells_own(lval *v)
+{
+  if (!v->cell) {
+    return;
+  }
+  lcells *c = lval_cells(v);
+  if (c->ref > 1) {
+    lval_cells_move(v, 0, 0);
+    return;
+  }
+  while (c->lo < v->off) {
+    lval_del(c->items[c->lo++]);
+  }
+  while (c->hi > v->off + v->count) {
+    lval_del(c->items[--c->hi]);
   }
-  putchar(close);
 }
 
+/* moves the cells of v to a buffer of their own with room for front and
+ * back more on either side */
 void
-lval_println(lval *v)
+lval_cells_move(lval *v, int front, int back)
 {
-  lval_print(v);
-  putchar('\n');
+  lcells *c = lcells_new(front + v->count + back);
+  if (v->cell) {
+    lcells *old = lval_cells(v);
+    if (old->ref > 1) {
+      for (int i = 0; i < v->count; i++) {
+        c->items[front + i] = lval_ref(v->cell[i]);
+      }
+      old->ref--;
+    } else {
+      lval_cells_own(v);
+      memcpy(c->items + front, v->cell, sizeof(lval*) * v->count);
+      lfree(old, sizeof(lcells) + sizeof(lval*) * old->cap);
+    }
+  }
+  c->lo = front;
+  c->hi = front + v->count;
+  v->cell = c->items + front;
+  v->off = front;
 }
 
+/* makes v's cells its own with room to append n more, growing the buffer
+ * geometrically so appends are amortized O(1) */
 lval*
-lval_pop(lval *v, int i)
+lval_reserve(lval *v, int n)
 {
-  lval *x = v->cell[i];
-  memmove(v->cell+i, v->cell+i+1, sizeof(lval*) * (v->count-i-1));
-
-  v->count--;
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-  return x;
+  lval_uncache(v);
+  lval_cells_own(v);
+  if (!v->cell) {
+    lval_cells_move(v, 0, n < 4 ? 4 : n);
+  } else if (v->off + v->count + n > lval_cells(v)->cap) {
+    lval_cells_move(v, 0, v->count + n);
+  }
+  return v;
 }
 
-lval*
-lval_take(lval *v, int i)
+/* whether x can hold references to other values, the types gc_mark
+ * looks into */
+static inline int
+lval_holds_refs(lval *x)
 {
-  lval *x = lval_pop(v, i);
-  lval_del(v);
-  return x;
+  switch (x->type) {
+  case LVAL_FUNC:
+    return !x->func;
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+  case LVAL_VEC:
+  case LVAL_MAP:
+    return 1;
+  }
+  return 0;
 }
 
-lval*
-lval_call(lenv* e, lval* f, lval *a)
+/* a shared buffer still takes appends in place when nothing lies past
+ * this view, since the other holders never look beyond their own. Only
+ * values that hold no references go in, anything else could lead back to
+ * the buffer and keep it alive through a cycle */
+int
+lval_append_shared(lval *v, lval **xs, int n)
 {
-  if (f->func) {
-    return f->func(e, a);
+  if (!v->cell) {
+    return 0;
   }
-  
-  int total = a->count;
-  int given = f->formals->count;
-  while (a->count) {
-    if (f->formals->count == 0) {
-      lval_del(a);
-      return lval_err("Function passed too many arguments: Got: %i, Expected: %i.", given, total);
+  lcells *c = lval_cells(v);
+  if (c->ref < 2 || v->off + v->count != c->hi || c->hi + n > c->cap) {
+    return 0;
+  }
+  for (int i = 0; i < n; i++) {
+    if (lval_holds_refs(xs[i])) {
+      return 0;
     }
-    
-    lval* sym = lval_pop(f->formals, 0);
-
-    if (strcmp(sym->sym, "&") == 0) {
-      // variable arguments
-      if (f->formals->count != 1) {
-        lval_del(a);
-        return lval_err("Function format invalid. "
-                        "Symbol '&' not followed by single symbol.");
-      }
-      lval* nsym = lval_pop(f->formals, 0);
-      lenv_put(f->env, nsym, builtin_list(e, a));
-      lval_del(nsym);
-      lval_del(sym);
-      break;
-    }
-
-    lval* val = lval_pop(a, 0);    
-    lenv_put(f->env, sym, val);
-    lval_del(sym);
-    lval_del(val);
-  }
-
-  lval_del(a);
-
-  /* if use doesnt support any variable arguments, assign empty list to the symbol after & */
-  if (f->formals->count > 0 && strcmp(f->formals->cell[0]->sym, "&") == 0) {
-    if (f->formals->count != 2) {
-      return lval_err("Function format invalid. "
-                      "Symbol '&' not followed by single symbol.");
-    }
-
-    lval_del(lval_pop(f->formals, 0));
-
-    lval *sym = lval_pop(f->formals, 0);
-    lval *val = lval_qexpr();
-
-    lenv_put(f->env, sym, val);
-    lval_del(sym);
-    lval_del(val);
-  }
-  
-  if (f->formals->count == 0) {
-    f->env->parent = e;
-    return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
-  } else {
-    return lval_copy(f);;
   }
+  lval_uncache(v);
+  return 1;
 }
 
 lval*
-eval_add(lval *x, lval *y)
+lval_add(lval *v, lval *x)
 {
-  if (x->type == LVAL_FNUM || y->type == LVAL_FNUM) {
-    // float
-    return lval_fnum(EXTRACT_FNUM(x) + EXTRACT_FNUM(y));
+  if (!lval_append_shared(v, &x, 1)) {
+    lval_reserve(v, 1);
   }
-  return lval_num(EXTRACT_NUM(x) + EXTRACT_NUM(y));
+  v->cell[v->count++] = x;
+  lval_cells(v)->hi++;
+  return v;
 }
 
 lval*
-eval_minus(lval *x, lval *y)
+lval_add_front(lval *v, lval *x)
 {
-  if (x->type == LVAL_FNUM || y->type == LVAL_FNUM) {
-    // float
-    return lval_fnum(EXTRACT_FNUM(x) - EXTRACT_FNUM(y));
+  lval_uncache(v);
+  lval_cells_own(v);
+  if (!v->off) {
+    /* room in front for as many cells again, consing stays amortized O(1) */
+    lval_cells_move(v, v->count + 4, 0);
   }
-  return lval_num(EXTRACT_NUM(x) - EXTRACT_NUM(y));
+  lval_cells(v)->lo--;
+  v->cell--;
+  v->off--;
+  v->cell[0] = x;
+  v->count++;
+  return v;
 }
 
-lval*
-eval_mod(lval *x, lval *y) {
-  if (x->type == LVAL_FNUM || y->type == LVAL_FNUM) {
-    // float
-    return lval_err("float modulo.");
-  }
-  return lval_num(EXTRACT_NUM(x) % EXTRACT_NUM(y));
+lenv*
+lenv_new(void)
+{
+  lenv *e = lpool_alloc(&lenv_pool);
+  e->gc = LGC_LIVE;
+  e->ref = 1;
+  e->parent = NULL;
+  e->count = 0;
+  e->cap = 0;
+  e->syms = NULL;
+  e->vals = NULL;
+  e->index = NULL;
+  e->index_cap = 0;
+  return e;
 }
 
-lval*
-eval_mul(lval *x, lval *y) {
-  if (x->type == LVAL_FNUM || y->type == LVAL_FNUM) {
-    // float
-    return lval_fnum(EXTRACT_FNUM(x) * EXTRACT_FNUM(y));
-  }
-  return lval_num(EXTRACT_NUM(x) * EXTRACT_NUM(y));
+static inline lenv*
+lenv_ref(lenv *e)
+{
+  e->ref++;
+  return e;
 }
 
-lval*
-eval_div(lval *x, lval *y) {
-  if (EXTRACT_VALUE(y) == 0) {
-    return lval_err("Division by zero.");
-  }
+static inline unsigned long
+lenv_hash(char *sym)
+{
+  return ((unsigned long)sym >> 4) * 11400714819323198485UL;
+}
 
-  if (x->type == LVAL_FNUM || y->type == LVAL_FNUM) {
-    // float
-    return lval_fnum(EXTRACT_FNUM(x) / EXTRACT_FNUM(y));
+void
+lenv_index_build(lenv *e)
+{
+  lfree(e->index, sizeof(int) * e->index_cap);
+  int cap = 32;
+  while (cap < e->count * 2) {
+    cap *= 2;
+  }
+  e->index_cap = cap;
+  e->index = lalloc(sizeof(int) * cap);
+  memset(e->index, -1, sizeof(int) * cap);
+
+  for (int n = 0; n < e->count; n++) {
+    unsigned long i = lenv_hash(e->syms[n]) & (cap - 1);
+    while (e->index[i] >= 0) {
+      i = (i + 1) & (cap - 1);
+    }
+    e->index[i] = n;
   }
-  return lval_num(EXTRACT_NUM(x) / EXTRACT_NUM(y));
 }
 
-lval*
-eval_min(lval *x, lval *y) {
-  if (x->type == LVAL_FNUM || y->type == LVAL_FNUM) {
-    // float
-    return lval_fnum(EXTRACT_VALUE(x) < EXTRACT_VALUE(y) ? EXTRACT_VALUE(x) : EXTRACT_VALUE(y));
+/* position of sym in e, or -1 */
+static inline int
+lenv_find(lenv *e, char *sym)
+{
+  if (e->index) {
+    unsigned long i = lenv_hash(sym) & (e->index_cap - 1);
+    while (e->index[i] >= 0) {
+      if (e->syms[e->index[i]] == sym) {
+        return e->index[i];
+      }
+      i = (i + 1) & (e->index_cap - 1);
+    }
+    return -1;
   }
-  return lval_num(EXTRACT_VALUE(x) < EXTRACT_VALUE(y) ? EXTRACT_VALUE(x) : EXTRACT_VALUE(y));
-}
 
-lval*
-eval_max(lval *x, lval *y) {
-  if (x->type == LVAL_FNUM || y->type == LVAL_FNUM) {
-    // float
-    return lval_fnum(EXTRACT_VALUE(x) > EXTRACT_VALUE(y) ? EXTRACT_VALUE(x) : EXTRACT_VALUE(y));
+  for (int i = 0; i < e->count; i++) {
+    if (e->syms[i] == sym) {
+      return i;
+    }
   }
-  return lval_num(EXTRACT_VALUE(x) > EXTRACT_VALUE(y) ? EXTRACT_VALUE(x) : EXTRACT_VALUE(y));
+  return -1;
 }
 
-lval*
-eval_pow(lval *x, lval *y)
+void
+lenv_del(lenv *e)
 {
-  if (x->type == LVAL_FNUM || y->type == LVAL_FNUM) {
-    // float
-    return lval_fnum(powl(EXTRACT_FNUM(x), EXTRACT_FNUM(y)));
+  if (--e->ref > 0) {
+    return;
+  }
+  for (int i = 0; i < e->count; i++) {
+    lval_del(e->vals[i]);
   }
-  return lval_num((long)powl(EXTRACT_FNUM(x), EXTRACT_FNUM(y)));
+  if (e->parent) {
+    lenv_del(e->parent);
+  }
+  lfree(e->syms, sizeof(char*) * e->cap);
+  lfree(e->vals, sizeof(lval*) * e->cap);
+  lfree(e->index, sizeof(int) * e->index_cap);
+  e->gc = 0;
+  lpool_free(&lenv_pool, e);
 }
 
 lval*
-eval_op(lval *x, const char *op, lval *y)
+lenv_get(lenv *e, lval *k)
 {
-  lval* r = NULL;
-  if (strcmp(op, "+") == 0) { r = eval_add(x, y); }
-  else if (strcmp(op, "-") == 0) { r = eval_minus(x, y); }
-  else if (strcmp(op, "*") == 0) { r = eval_mul(x, y); }
-  else if (strcmp(op, "%") == 0) { r = eval_mod(x, y); }
-  else if (strcmp(op, "min") == 0) { r =  eval_min(x, y); }
-  else if (strcmp(op, "max") == 0) { r = eval_max(x, y); }
-  else if (strcmp(op, "^") == 0) { r = eval_pow(x, y); }
-  else if (strcmp(op, "/") == 0) { r = eval_div(x, y); }
-  else { r = lval_err("invalid op"); }
-  
-  return r;
+  /* The address is only a hint. Scoping is dynamic, so any frame in
+   * front of the one it points at may bind the symbol as well and is
+   * searched first, then the slot is used if it still holds the symbol */
+  if (k->slot) {
+    for (int d = k->depth; e && d > 0; d--, e = e->parent) {
+      int i = lenv_find(e, k->sym);
+      if (i >= 0) {
+        return lval_ref(e->vals[i]);
+      }
+    }
+    if (e && k->slot <= e->count && e->syms[k->slot - 1] == k->sym) {
+      return lval_ref(e->vals[k->slot - 1]);
+    }
+  }
+
+  for (; e; e = e->parent) {
+    int i = lenv_find(e, k->sym);
+    if (i >= 0) {
+      return lval_ref(e->vals[i]);
+    }
+  }
+
+  return lval_err("unbound symbol: %s", k->sym);
 }
 
-lval*
-eval_unary(const char *op, lval *a)
+/* define local variable */
+void
+lenv_put_sym(lenv *e, char *sym, lval *v)
 {
-  lval *x = NULL;
-  if (a->type == LVAL_FNUM) {
-    x = lval_fnum(a->fnum);
-  } else if (a->type == LVAL_NUM) {
-    x = lval_num(a->num);
-  } else {
-    return lval_err("require a number"); 
+  int i = lenv_find(e, sym);
+  if (i >= 0) {
+    lval_del(e->vals[i]);
+    e->vals[i] = lval_ref(v);
+    return;
   }
 
-  if (strcmp(op, "+") == 0) { return x; }
-  if (strcmp(op, "-") == 0) {
-    if (x->type == LVAL_FNUM) {
-      x->fnum = -x->fnum;
-    }
-    if (x->type == LVAL_NUM) {
-      x->num = -x->num;
+  if (e->count == e->cap) {
+    int cap = e->cap ? e->cap * 2 : 4;
+    e->vals = lrealloc(e->vals, sizeof(lval *) * e->cap, sizeof(lval *) * cap);
+    e->syms = lrealloc(e->syms, sizeof(char *) * e->cap, sizeof(char *) * cap);
+    e->cap = cap;
+  }
+  e->vals[e->count] = lval_ref(v);
+  e->syms[e->count] = sym;
+  e->count++;
+
+  if (e->index && e->count * 2 <= e->index_cap) {
+    unsigned long j = lenv_hash(sym) & (e->index_cap - 1);
+    while (e->index[j] >= 0) {
+      j = (j + 1) & (e->index_cap - 1);
     }
-    return x;
-  };
-  lval_del(x);
-  return lval_err("invalid expression");
+    e->index[j] = e->count - 1;
+  } else if (e->count >= LENV_INDEX_MIN) {
+    lenv_index_build(e);
+  }
 }
 
-lval*
-builtin_head(lenv* e, lval *a)
+static inline void
+lenv_put(lenv *e, lval *k, lval *v)
 {
-  LASSERT_NUM("head", a, 1);
-  LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
-  LASSERT_EMPTY("head", a);
+  lenv_put_sym(e, k->sym, v);
+}
 
-  lval* v = lval_take(a, 0);
-  while (v->count > 1) {
-    lval_del(lval_pop(v, 1));
+/* define global variable */
+void
+lenv_def(lenv *e, lval *k, lval *v)
+{
+  while (e->parent) {
+    e = e->parent;
   }
-  return v;
+  lenv_put(e, k, v);
 }
 
-lval*
-builtin_tail(lenv* e, lval *a)
+/* Mark and sweep collector. Reference counting frees most values as soon
+ * as they die, the collector picks up whatever it cannot: cycles and
+ * anything leaked. It only runs at safe points between top level forms,
+ * when every live object is reachable from the global env or the root
+ * stack. */
+typedef struct {
+  lenv *global;
+  lval *roots[64];
+  int nroots;
+  int depth;
+  int requested;
+
+  long threshold;
+  long next;
+
+  long collections;
+  long objects;
+  long bytes;
+  long last_pause;
+  long max_pause;
+  long total_pause;
+} lgc;
+
+lgc gc = { .threshold = 1 << 16, .next = 1 << 16 };
+
+typedef struct {
+  int is_env;
+  void *p;
+} lgc_item;
+
+typedef struct {
+  lgc_item *items;
+  int count;
+  int cap;
+} lgc_stack;
+
+void
+gc_push_root(lval *v)
 {
-  LASSERT_NUM("tail", a, 1);
-  LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
-  LASSERT_EMPTY("tail", a);
-  
-  lval* v = lval_take(a, 0);
-  lval_del(lval_pop(v, 0));
-  return v;
+  assert(gc.nroots < sizeof(gc.roots) / sizeof(gc.roots[0]));
+  gc.roots[gc.nroots++] = v;
 }
 
-lval*
-builtin_strtail(lenv* e, lval *a)
+void
+gc_pop_root(void)
 {
-  LASSERT_NUM("strtail", a, 1);
-  LASSERT_TYPE("strtail", a, 0, LVAL_STR);
-  LASSERT_EMPTY("strtail", a);
+  gc.nroots--;
+}
 
-  unsigned long length = strlen(a->cell[0]->sym);
-  lval *v;
-  if (length == 0) {
-    v = lval_str("");
-  } else {
-    char *str = malloc(length);
-    strncpy(str, a->cell[0]->sym + 1, length - 1);
-    str[length - 1] = 0;
-    v = lval_str(str);
-    free(str);
+static inline long
+gc_heap_objects(void)
+{
+  long n = lenv_pool.allocs - lenv_pool.frees;
+  for (int i = 0; i < LPOOL_COUNT; i++) {
+    n += lval_pools[i].allocs - lval_pools[i].frees;
   }
-  lval_del(a);
-  return v;
+  return n;
 }
 
-lval*
-builtin_strjoin(lenv* e, lval *a)
+void
+gc_push(lgc_stack *st, int is_env, void *p)
 {
-  LASSERT_TYPE("strjoin", a, 0, LVAL_STR);
-  LASSERT_EMPTY("strjoin", a);
-
-  int length = 0;
-  for (int i = 0; i < a->count; i++) {
-    length += strlen(a->cell[i]->sym);
+  if (!p) {
+    return;
   }
-  char *str = malloc(length+1);
-  str[length] = 0;
-   
-  int offset = 0;
-  for (int i = 0; i < a->count; i++) {
-    strcpy(str+offset, a->cell[i]->sym);
-    offset += strlen(a->cell[i]->sym);
+  unsigned char *flags = is_env ? &((lenv*)p)->gc : &((lval*)p)->gc;
+  if (*flags & (LGC_MARK | LGC_STATIC)) {
+    return;
   }
+  *flags |= LGC_MARK;
 
-  lval* v = lval_str(str);
-  free(str);
-  lval_del(a);
-  return v;
+  if (st->count == st->cap) {
+    st->cap = st->cap ? st->cap * 2 : 256;
+    st->items = realloc(st->items, sizeof(lgc_item) * st->cap);
+  }
+  st->items[st->count].is_env = is_env;
+  st->items[st->count].p = p;
+  st->count++;
 }
 
-lval*
-builtin_strhead(lenv* e, lval *a)
+void
+gc_push_vnode(lgc_stack *st, lvnode *n)
 {
-  LASSERT_NUM("strhead", a, 1);
-  LASSERT_TYPE("strhead", a, 0, LVAL_STR);
-  
-  lval* v;
-  int length = strlen(a->cell[0]->sym);
-  if (length == 0) {
-    v = lval_str("");
-  } else {
-    char str[2];
-    str[0] = a->cell[0]->sym[0];
-    str[1] = 0;
-    v = lval_str(str);
+  if (!n || n->mark == gc.collections + 1) {
+    return;
+  }
+  n->mark = gc.collections + 1;
+  for (int i = 0; i < LVEC_WIDTH; i++) {
+    if (n->shift) {
+      gc_push_vnode(st, n->kids[i]);
+    } else {
+      gc_push(st, 0, n->vals[i]);
+    }
   }
-
-  lval_del(a);
-  return v;
 }
 
-lval*
-builtin_list(lenv* e, lval *a)
+void
+gc_push_hnode(lgc_stack *st, lhnode *n)
 {
-  a->type = LVAL_QEXPR;
-  return a;
+  if (!n || n->mark == gc.collections + 1) {
+    return;
+  }
+  n->mark = gc.collections + 1;
+  for (int i = 0; i < n->count; i++) {
+    if (n->slots[i].key) {
+      gc_push(st, 0, n->slots[i].key);
+      gc_push(st, 0, n->slots[i].val);
+    } else {
+      gc_push_hnode(st, n->slots[i].node);
+    }
+  }
 }
 
-lval*
-builtin_len(lenv* e, lval *a)
+void
+gc_mark(void)
 {
-  LASSERT_TYPE("len", a, 0, LVAL_QEXPR);
-  lval* v = lval_num(a->cell[0]->count);
-  lval_del(a);
-  return v;
-}
+  lgc_stack st = { NULL, 0, 0 };
+  gc_push(&st, 1, gc.global);
+  for (int i = 0; i < gc.nroots; i++) {
+    gc_push(&st, 0, gc.roots[i]);
+  }
 
-lval*
-builtin_init(lenv* e, lval *a)
-{
-  LASSERT_NUM("init", a, 1);
-  LASSERT_TYPE("init", a, 0, LVAL_QEXPR);
-  LASSERT_EMPTY("init", a);
-  
-  lval* v = lval_take(a, 0);
-  lval_del(lval_pop(v, v->count-1));
-  return v;
+  while (st.count) {
+    lgc_item it = st.items[--st.count];
+    if (it.is_env) {
+      lenv *e = it.p;
+      for (int i = 0; i < e->count; i++) {
+        gc_push(&st, 0, e->vals[i]);
+      }
+      gc_push(&st, 1, e->parent);
+      continue;
+    }
+
+    lval *v = it.p;
+    switch (v->type) {
+    case LVAL_FUNC:
+      if (!v->func) {
+        gc_push(&st, 1, v->env);
+        gc_push(&st, 0, v->formals);
+        gc_push(&st, 0, v->body);
+      }
+      break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      /* the buffer holds its whole range, not just this window */
+      if (v->cell && lval_cells(v)->mark != gc.collections + 1) {
+        lcells *c = lval_cells(v);
+        c->mark = gc.collections + 1;
+        for (int i = c->lo; i < c->hi; i++) {
+          gc_push(&st, 0, c->items[i]);
+        }
+      }
+      break;
+    case LVAL_VEC:
+      gc_push_vnode(&st, v->root);
+      break;
+    case LVAL_MAP:
+      gc_push_hnode(&st, v->hroot);
+      break;
+    }
+  }
+  free(st.items);
 }
 
-lval*
-builtin_cons(lenv* e, lval *a)
+/* a dead object still holds references to live ones, give them back */
+static inline void
+gc_unref(lval *v)
 {
-  LASSERT_NUM("cons", a, 2);
-  LASSERT_TYPE("cons", a, 1, LVAL_QEXPR);  
-  
-  lval *v = lval_pop(a, 0);
-  lval *qlist = lval_take(a, 0);
-  lval_add_front(qlist, v);
-  return qlist;
+  if (v && (v->gc & LGC_MARK)) {
+    v->ref--;
+  }
 }
 
-lval*
-builtin_eval(lenv* e, lval *a)
+static inline void
+gc_unref_env(lenv *e)
 {
-  LASSERT_NUM("eval", a, 1);
-  LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
-    
-  lval *x = lval_take(a, 0);
-  x->type = LVAL_SEXPR;
-  return lval_eval(e, x);
+  if (e && (e->gc & LGC_MARK)) {
+    e->ref--;
+  }
 }
 
-lval*
-builtin_ord(lenv *e, lval *a, const char* op)
+long
+gc_release_vnode(lvnode *n)
 {
-  LASSERT_NUM(op, a, 2);
-  LASSERT_TYPE_NUMBER(op, a, 0);
-  LASSERT_TYPE_NUMBER(op, a, 1);
-
-  int i = 0;
-  if (strcmp(op, ">") == 0) {
-    i = EXTRACT_VALUE(a->cell[0]) > EXTRACT_VALUE(a->cell[1]);
-  } else if (strcmp(op, ">=") == 0) {
-    i = EXTRACT_VALUE(a->cell[0]) >= EXTRACT_VALUE(a->cell[1]);    
-  } else if (strcmp(op, "<") == 0) {
-    i = EXTRACT_VALUE(a->cell[0]) < EXTRACT_VALUE(a->cell[1]);
-  } else if (strcmp(op, "<=") == 0) {
-    i = EXTRACT_VALUE(a->cell[0]) <= EXTRACT_VALUE(a->cell[1]);
+  if (!n || --n->ref > 0) {
+    return 0;
   }
-  
-  return lval_bool(i);
+  long bytes = sizeof(lvnode);
+  for (int i = 0; i < LVEC_WIDTH; i++) {
+    if (n->shift) {
+      bytes += gc_release_vnode(n->kids[i]);
+    } else {
+      gc_unref(n->vals[i]);
+    }
+  }
+  lfree(n, sizeof(lvnode));
+  return bytes;
 }
 
-static inline lval*
-builtin_gt(lenv *e, lval *a)
+long
+gc_release_hnode(lhnode *n)
 {
-  return builtin_ord(e, a, ">");
+  if (!n || --n->ref > 0) {
+    return 0;
+  }
+  long bytes = sizeof(lhnode) + sizeof(lhslot) * n->count;
+  for (int i = 0; i < n->count; i++) {
+    if (n->slots[i].key) {
+      gc_unref(n->slots[i].key);
+      gc_unref(n->slots[i].val);
+    } else {
+      bytes += gc_release_hnode(n->slots[i].node);
+    }
+  }
+  lfree(n, sizeof(lhnode) + sizeof(lhslot) * n->count);
+  return bytes;
+}
+
+long
+gc_release_lval(lval *v)
+{
+  long bytes = lval_pools[v->pool].size;
+  switch (v->type) {
+  case LVAL_STR:
+    if (v->map) {
+      lmap_del(v->map);
+      break;
+    }
+    bytes += v->slen + 1;
+    lfree(v->sym, v->slen + 1);
+    break;
+  case LVAL_ERR:
+    bytes += strlen(v->err) + 1;
+    lstrfree(v->err);
+    break;
+  case LVAL_FUNC:
+    if (!v->func) {
+      gc_unref_env(v->env);
+      gc_unref(v->formals);
+      gc_unref(v->body);
+    }
+    break;
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    if (v->cell && --lval_cells(v)->ref == 0) {
+      lcells *c = lval_cells(v);
+      for (int i = c->lo; i < c->hi; i++) {
+        gc_unref(c->items[i]);
+      }
+      bytes += sizeof(lcells) + sizeof(lval*) * c->cap;
+      lfree(c, sizeof(lcells) + sizeof(lval*) * c->cap);
+    }
+    lval_uncache(v);
+    break;
+  case LVAL_VEC:
+    bytes += gc_release_vnode(v->root);
+    break;
+  case LVAL_MAP:
+    bytes += gc_release_hnode(v->hroot);
+    break;
+  case LVAL_NUMS:
+    if (v->nums->ref == 1) {
+      bytes += sizeof(lnums) + sizeof(long) * v->nums->len;
+    }
+    lnums_del(v->nums);
+    break;
+  case LVAL_BIG:
+    if (v->big->ref == 1) {
+      bytes += sizeof(lbig) + sizeof(unsigned) * v->big->cap;
+    }
+    lbig_del(v->big);
+    break;
+  }
+  return bytes;
+}
+
+long
+gc_release_lenv(lenv *e)
+{
+  long bytes = sizeof(lenv) + (sizeof(char*) + sizeof(lval*)) * e->cap + sizeof(int) * e->index_cap;
+  for (int i = 0; i < e->count; i++) {
+    gc_unref(e->vals[i]);
+  }
+  gc_unref_env(e->parent);
+  lfree(e->syms, sizeof(char*) * e->cap);
+  lfree(e->vals, sizeof(lval*) * e->cap);
+  lfree(e->index, sizeof(int) * e->index_cap);
+  return bytes;
+}
+
+void
+gc_sweep_pool(lpool *p, int is_env, int release)
+{
+  size_t size = p->size < sizeof(void*) ? sizeof(void*) : p->size;
+  for (lslab *s = p->slabs; s; s = s->next) {
+    for (size_t i = 0; i < s->nslots; i++) {
+      void *x = s->data + i * size;
+      unsigned char *flags = is_env ? &((lenv*)x)->gc : &((lval*)x)->gc;
+      if (!(*flags & LGC_LIVE)) {
+        continue;
+      }
+      if (*flags & LGC_MARK) {
+        if (!release) {
+          *flags &= ~LGC_MARK;
+        }
+        continue;
+      }
+
+      /* releasing first and freeing afterwards keeps every dead object
+       * readable while its neighbours are being released */
+      if (release) {
+        gc.bytes += is_env ? gc_release_lenv(x) : gc_release_lval(x);
+        gc.objects++;
+      } else {
+        *flags = 0;
+        lpool_free(p, x);
+      }
+    }
+  }
+}
+
+void
+gc_collect(void)
+{
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  gc_mark();
+  for (int i = 0; i < LPOOL_COUNT; i++) {
+    gc_sweep_pool(&lval_pools[i], 0, 1);
+  }
+  gc_sweep_pool(&lenv_pool, 1, 1);
+  for (int i = 0; i < LPOOL_COUNT; i++) {
+    gc_sweep_pool(&lval_pools[i], 0, 0);
+  }
+  gc_sweep_pool(&lenv_pool, 1, 0);
+
+  long live = gc_heap_objects();
+  gc.next = live * 2 > gc.threshold ? live * 2 : gc.threshold;
+  gc.requested = 0;
+  gc.collections++;
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  gc.last_pause = (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000;
+  gc.total_pause += gc.last_pause;
+  if (gc.last_pause > gc.max_pause) {
+    gc.max_pause = gc.last_pause;
+  }
+}
+
+/* called between top level forms, collects once the heap has grown past
+ * the threshold */
+void
+gc_safe_point(void)
+{
+  if (gc.depth || !gc.global) {
+    return;
+  }
+  if (gc.requested || gc_heap_objects() > gc.next) {
+    gc_collect();
+  }
+}
+
+lval*
+lval_read_str(mpc_ast_t* t)
+{
+  // remove quote characters 
+  t->contents[strlen(t->contents)-1] = 0;
+  char *unescaped = malloc(strlen(t->contents+1)+1);
+  strcpy(unescaped, t->contents+1);
+  unescaped = mpcf_unescape(unescaped);
+  lval* v = lval_str(unescaped);
+  free(unescaped);
+  return v;
+}
+
+lval*
+lval_read(mpc_ast_t *t) {
+  if (strstr(t->tag, "fnumber")) {
+    return lval_read_fnum(t->contents);
+  }
+  
+  if (strstr(t->tag, "number")) {
+    return lval_read_num(t->contents);
+  }
+
+  if (strstr(t->tag, "symbol")) {
+    return lval_sym(t->contents);
+  }
+
+  if (strstr(t->tag, "string")) {
+    return lval_read_str(t);
+  }
+
+  lval *x = NULL;
+  // root
+  if (strcmp(t->tag, ">") == 0 || strstr(t->tag, "sexpr")) {
+    x = lval_sexpr();
+  } else if (strstr(t->tag, "qexpr")) {
+    x = lval_qexpr();
+  }
+
+  for (int i = 0; i < t->children_num; i++) {
+    if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
+    if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
+    if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
+    if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
+    if (strcmp(t->children[i]->tag, "regex") == 0) { continue; }
+    if (strstr(t->children[i]->tag, "comment")) { continue; }
+    x = lval_add(x, lval_read(t->children[i]));
+  }
+  return x;
+}
+
+lval*
+lread_err(lreader *r, char *fmt, ...)
+{
+  va_list va;
+  va_start(va, fmt);
+  larena_mark m = larena_save(&scratch);
+  char *msg = larena_alloc(&scratch, 512);
+  vsnprintf(msg, 511, fmt, va);
+  va_end(va);
+  lval *x = lval_err("%s:%i:%i: error: %s", r->name, r->row, (int)(r->pos - r->line) + 1, msg);
+  larena_restore(&scratch, m);
+  return x;
+}
+
+/* Makes n more bytes past pos available, reading from the file when the
+ * buffer runs dry. Returns 0 at end of input. Data is only ever appended
+ * here, offsets into the buffer stay valid while a form is being read. */
+int
+lread_fill(lreader *r, size_t n)
+{
+  while (r->pos + n > r->len) {
+    if (!r->f) {
+      return 0;
+    }
+    if (r->len == r->cap) {
+      r->cap = r->cap ? r->cap * 2 : LREAD_CHUNK;
+      r->own = realloc(r->own, r->cap);
+      r->buf = r->own;
+    }
+    size_t got = fread(r->own + r->len, 1, r->cap - r->len, r->f);
+    if (got == 0) {
+      return 0;
+    }
+    r->len += got;
+  }
+  return 1;
+}
+
+/* current byte, -1 at end of input */
+static inline int
+lread_peek(lreader *r, size_t ahead)
+{
+  if (r->pos + ahead >= r->len && !lread_fill(r, ahead + 1)) {
+    return -1;
+  }
+  return (unsigned char)r->buf[r->pos + ahead];
+}
+
+static inline int
+lread_issym(int c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+    || (c > 0 && strchr("_+-*/\\=<>!&%^", c) != NULL);
+}
+
+static inline int
+lread_isdigit(int c)
+{
+  return c >= '0' && c <= '9';
+}
+
+/* skips whitespace and comments */
+void
+lread_skip(lreader *r)
+{
+  int c;
+  while ((c = lread_peek(r, 0)) >= 0) {
+    if (c == '\n') {
+      r->pos++;
+      r->row++;
+      r->line = r->pos;
+    } else if (c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v') {
+      r->pos++;
+    } else if (c == ';') {
+      while ((c = lread_peek(r, 0)) >= 0 && c != '\n' && c != '\r') {
+        r->pos++;
+      }
+      r->comments++;
+    } else {
+      break;
+    }
+  }
+}
+
+lval*
+lread_num(lreader *r)
+{
+  size_t start = r->pos;
+  int fnum = 0;
+  if (lread_peek(r, 0) == '-') {
+    r->pos++;
+  }
+  while (lread_isdigit(lread_peek(r, 0))) {
+    r->pos++;
+  }
+  if (lread_peek(r, 0) == '.' && lread_isdigit(lread_peek(r, 1))) {
+    fnum = 1;
+    r->pos++;
+    while (lread_isdigit(lread_peek(r, 0))) {
+      r->pos++;
+    }
+  }
+
+  larena_mark m = larena_save(&scratch);
+  size_t len = r->pos - start;
+  char *tok = larena_alloc(&scratch, len + 1);
+  memcpy(tok, r->buf + start, len);
+  tok[len] = 0;
+  lval *x = fnum ? lval_read_fnum(tok) : lval_read_num(tok);
+  larena_restore(&scratch, m);
+  return x;
+}
+
+lval*
+lread_str(lreader *r)
+{
+  size_t start = r->pos++;
+  long line = r->line;
+  int row = r->row;
+  int c;
+  while ((c = lread_peek(r, 0)) >= 0 && c != '"') {
+    if (c == '\\' && lread_peek(r, 1) >= 0) {
+      r->pos++;
+      c = lread_peek(r, 0);
+    }
+    r->pos++;
+    if (c == '\n') {
+      r->row++;
+      r->line = r->pos;
+    }
+  }
+  if (c < 0) {
+    r->pos = start;
+    r->line = line;
+    r->row = row;
+    return lread_err(r, "unterminated string");
+  }
+
+  /* strings of a mapped file stay where they are */
+  if (r->map) {
+    lval *x = new_lval(LPOOL_SEQ);
+    x->type = LVAL_STR;
+    x->sym = (char*)r->buf + start + 1;
+    x->slen = r->pos - start - 1;
+    x->raw = 1;
+    x->map = lmap_ref(r->map);
+    r->pos++;
+    return x;
+  }
+
+  larena_mark m = larena_save(&scratch);
+  char *buf = larena_alloc(&scratch, r->pos - start);
+  size_t len = lstr_unescape(buf, r->buf + start + 1, r->pos - start - 1);
+  r->pos++;
+  lval *x = lval_str_len(buf, len);
+  larena_restore(&scratch, m);
+  return x;
+}
+
+lval *lread_expr(lreader *r);
+
+lval*
+lread_list(lreader *r, lval *x, char close)
+{
+  r->pos++;
+  while (1) {
+    lread_skip(r);
+    int c = lread_peek(r, 0);
+    if (c < 0) {
+      lval_del(x);
+      return lread_err(r, "expected '%c' at end of input", close);
+    }
+    if (c == close) {
+      r->pos++;
+      return x;
+    }
+    lval *y = lread_expr(r);
+    if (y->type == LVAL_ERR) {
+      lval_del(x);
+      return y;
+    }
+    lval_add(x, y);
+  }
+}
+
+lval*
+lread_expr(lreader *r)
+{
+  int c = lread_peek(r, 0);
+  if (c == '(') {
+    return lread_list(r, lval_sexpr(), ')');
+  }
+  if (c == '{') {
+    return lread_list(r, lval_qexpr(), '}');
+  }
+  if (c == '"') {
+    return lread_str(r);
+  }
+  if (lread_isdigit(c) || (c == '-' && lread_isdigit(lread_peek(r, 1)))) {
+    return lread_num(r);
+  }
+  if (lread_issym(c)) {
+    size_t start = r->pos;
+    while (lread_issym(lread_peek(r, 0))) {
+      r->pos++;
+    }
+    lval *x = new_lval(LPOOL_SYM);
+    x->type = LVAL_SYM;
+    x->sym = lsym_intern_len(r->buf + start, r->pos - start);
+    return x;
+  }
+  if (c >= ' ' && c <= '~') {
+    return lread_err(r, "unexpected '%c'", c);
+  }
+  return lread_err(r, "unexpected byte 0x%02x", c);
+}
+
+void
+lread_init(lreader *r, const char *name, const char *src, size_t len, FILE *f)
+{
+  memset(r, 0, sizeof(lreader));
+  r->name = name;
+  r->buf = src;
+  r->len = len;
+  r->f = f;
+  r->row = 1;
+}
+
+void
+lread_close(lreader *r)
+{
+  free(r->own);
+}
+
+/* Reads the next top level expression, NULL once the input is exhausted.
+ * Bytes of the forms already read are dropped first, so reading a file
+ * only ever buffers the form at hand. */
+lval*
+lread_next(lreader *r)
+{
+  if (r->own && r->pos) {
+    memmove(r->own, r->own + r->pos, r->len - r->pos);
+    r->len -= r->pos;
+    r->line -= r->pos;
+    r->pos = 0;
+  }
+
+  lread_skip(r);
+  if (lread_peek(r, 0) < 0) {
+    if (r->forms == 0 && r->comments == 0) {
+      return lread_err(r, "expected expression at end of input");
+    }
+    return NULL;
+  }
+  r->forms++;
+  return lread_expr(r);
+}
+
+/* reads every expression in the buffer into an S-Expression */
+lval*
+lread_all(const char *name, const char *src, size_t len)
+{
+  lreader r;
+  lread_init(&r, name, src, len, NULL);
+  lval *x = lval_sexpr();
+  lval *y;
+  while ((y = lread_next(&r))) {
+    if (y->type == LVAL_ERR) {
+      lval_del(x);
+      return y;
+    }
+    lval_add(x, y);
+  }
+  return x;
+}
+
+char*
+ltype_name(int t)
+{
+  switch(t) {
+  case LVAL_STR: return "string";
+  case LVAL_FUNC: return "Function";
+  case LVAL_NUM:
+  case LVAL_FNUM:
+  case LVAL_BIG:
+    return "Number";
+  case LVAL_ERR: return "Error";
+  case LVAL_SYM: return "Symbol";
+  case LVAL_SEXPR: return "S-Expression";
+  case LVAL_QEXPR: return "Q-Expression";
+  case LVAL_VEC: return "Vector";
+  case LVAL_MAP: return "Map";
+  case LVAL_NUMS: return "Array";
+  default: return "Unknown";
+  }
+}
+
+lval*
+lval_tobool(lval *v)
+{
+  int i = 0;
+  switch (v->type) {
+  case LVAL_STR:
+    lstr(v);
+    i = v->slen;
+    break;
+  case LVAL_NUM:
+  case LVAL_FNUM:
+    i = EXTRACT_VALUE(v) != 0;
+    break;
+  case LVAL_BIG:
+    i = 1;
+    break;
+  case LVAL_QEXPR:
+  case LVAL_SEXPR:
+  case LVAL_VEC:
+  case LVAL_MAP:
+  case LVAL_NUMS:
+    i = v->count;
+    break;
+  case LVAL_SYM:
+    i = strlen(v->sym);
+    break;
+  case LVAL_BOOL:
+    return lval_bool(v->num);
+  default:
+    return lval_err("cannot convert %s to bool", ltype_name(v->type));
+  }
+  return lval_bool(i);
+}
+
+/* prints with the escapes mpcf_escape uses, a NUL byte as \0 */
+void
+lval_print_str(lval *v)
+{
+  char *s = lstr(v);
+  putchar('"');
+  for (int i = 0; i < v->slen; i++) {
+    const char *esc = memchr(lstr_chars, s[i], sizeof(lstr_chars));
+    if (esc) {
+      putchar('\\');
+      putchar(lstr_escapes[esc - lstr_chars]);
+    } else {
+      putchar(s[i]);
+    }
+  }
+  putchar('"');
+}
+
+void
+lval_print(lval *v)
+{
+  switch (v->type) {
+  case LVAL_STR:
+    lval_print_str(v);
+    break;
+  case LVAL_BOOL: 
+    if (v->num) {
+      printf("<true>");
+    } else {
+      printf("<false>"); 
+    }
+    break;
+  case LVAL_FUNC:
+    if (v->func) {
+      printf("<builtin function>");
+    } else {
+      printf("(\\ "); lval_print(v->formals);
+      putchar(' '); lval_print(v->body); putchar(' ');
+    }
+    break;
+  case LVAL_NUM:
+    printf("%li", v->num);
+    break;
+  case LVAL_FNUM:
+    printf("%f", v->fnum);
+    break;
+  case LVAL_SYM:
+    printf("%s", v->sym);
+    break;
+  case LVAL_ERR:
+    printf("Error: %s", v->err);
+    break;
+  case LVAL_SEXPR:
+    lval_expr_print(v, '(', ')');
+    break;
+  case LVAL_QEXPR:
+    lval_expr_print(v, '{', '}');
+    break;    
+  case LVAL_VEC:
+    lval_vec_print(v);
+    break;
+  case LVAL_MAP:
+    lval_map_print(v);
+    break;
+  case LVAL_NUMS:
+    lval_nums_print(v);
+    break;
+  case LVAL_BIG:
+    lval_big_print(v);
+    break;
+  default:
+     break;    
+  }
+}
+
+/* shallow copy, children are shared with the original */
+lval*
+lval_copy(lval *v)
+{
+  lval *x = new_lval(v->pool);
+  x->type = v->type;
+  switch (x->type) {
+  case LVAL_STR:
+    lstr_share(v);
+    x->sym = v->sym;
+    x->map = lmap_ref(v->map);
+    x->slen = v->slen;
+    break;
+  case LVAL_BOOL:
+    x->num = v->num;
+    break;
+  case LVAL_FUNC:
+    if (v->func) {
+      x->func = v->func;
+    } else {
+      x->env = v->env ? lenv_ref(v->env) : NULL;
+      x->formals = lval_ref(v->formals);
+      x->body = lval_ref(v->body);
+    }
+
+    break;
+  case LVAL_NUM: x->num = v->num; break;
+  case LVAL_FNUM: x->fnum = v->fnum; break;
+  case LVAL_ERR:
+    x->err = lstrdup(v->err);
+    break;
+  case LVAL_SYM:
+    x->sym = v->sym;
+    x->depth = v->depth;
+    x->slot = v->slot;
+    break;
+  case LVAL_QEXPR:
+  case LVAL_SEXPR:
+    x->count = v->count;
+    x->off = v->off;
+    x->cell = v->cell;
+    if (v->cell) {
+      lval_cells(v)->ref++;
+    }
+    break;
+  case LVAL_VEC:
+    x->count = v->count;
+    x->off = v->off;
+    x->root = v->root;
+    if (v->root) {
+      v->root->ref++;
+    }
+    break;
+  case LVAL_MAP:
+    x->count = v->count;
+    x->hroot = v->hroot;
+    if (v->hroot) {
+      v->hroot->ref++;
+    }
+    break;
+  case LVAL_NUMS:
+    x->count = v->count;
+    x->nums = v->nums;
+    v->nums->ref++;
+    break;
+  case LVAL_BIG:
+    x->big = v->big;
+    v->big->ref++;
+    break;
+  }
+  return x;
+}
+
+/* make v safe to modify in place, copying it if anybody else holds it */
+lval*
+lval_own(lval *v)
+{
+  if (v->ref == 1) {
+    return v;
+  }
+  lval *x = lval_copy(v);
+  lval_del(v);
+  return x;
+}
+
+void
+lval_expr_print(lval *v, char open, char close)
+{
+  putchar(open);
+  for (int i = 0; i < v->count; i++) {
+    lval_print(v->cell[i]);
+
+    if (i != v->count - 1) {
+      putchar(' ');
+    }
+  }
+  putchar(close);
+}
+
+void
+lval_vec_print(lval *v)
+{
+  putchar('[');
+  for (int i = 0; i < v->count; i++) {
+    lval_print(lvec_get(v, i));
+
+    if (i != v->count - 1) {
+      putchar(' ');
+    }
+  }
+  putchar(']');
+}
+
+/* a numeric array prints as #[1 2 3] */
+void
+lval_nums_print(lval *v)
+{
+  printf("#[");
+  for (int i = 0; i < v->count; i++) {
+    if (v->nums->flt) {
+      printf("%f", lnums_flts(v->nums)[i]);
+    } else {
+      printf("%li", v->nums->ints[i]);
+    }
+    if (i != v->count - 1) {
+      putchar(' ');
+    }
+  }
+  putchar(']');
+}
+
+/* a map prints as #{key value ...} */
+void
+lval_map_print(lval *v)
+{
+  lval *q = lval_qexpr();
+  lhnode_list(v->hroot, q, 1);
+  putchar('#');
+  lval_expr_print(q, '{', '}');
+  lval_del(q);
+}
+
+void
+lval_println(lval *v)
+{
+  lval_print(v);
+  putchar('\n');
+}
+
+lval*
+lval_pop(lval *v, int i)
+{
+  lval_uncache(v);
+  lval_cells_own(v);
+  lcells *c = lval_cells(v);
+  lval *x = v->cell[i];
+  if (i == 0) {
+    c->lo++;
+    v->cell++;
+    v->off++;
+  } else {
+    memmove(v->cell+i, v->cell+i+1, sizeof(lval*) * (v->count-i-1));
+    c->hi--;
+  }
+  v->count--;
+  return x;
+}
+
+lval*
+lval_take(lval *v, int i)
+{
+  lval *x = lval_ref(v->cell[i]);
+  lval_del(v);
+  return x;
+}
+
+/* cells from up to to of v, sharing its buffer */
+lval*
+lval_slice(lval *v, int from, int to)
+{
+  v = lval_own(v);
+  lval_uncache(v);
+  if (v->cell) {
+    v->cell += from;
+    v->off += from;
+    v->count = to - from;
+    if (lval_cells(v)->ref == 1) {
+      lval_cells_own(v);
+    }
+  }
+  return v;
+}
+
+/* bytes from up to to of a string */
+lval*
+lstr_slice(lval *v, int from, int to)
+{
+  if (to - from < LSTR_SHARE_MIN) {
+    lval *x = lval_str_len(lstr(v) + from, to - from);
+    lval_del(v);
+    return x;
+  }
+  lstr_share(v);
+  v = lval_own(v);
+  v->sym += from;
+  v->slen = to - from;
+  return v;
+}
+
+/* puts x at trie index t below n, taking over the caller's reference to
+ * n and returning the node that replaces it */
+lvnode*
+lvnode_set(lvnode *n, int t, lval *x)
+{
+  if (n->ref > 1) {
+    lvnode *c = lvnode_new(n->shift);
+    for (int i = 0; i < LVEC_WIDTH; i++) {
+      if (n->shift && n->kids[i]) {
+        c->kids[i] = n->kids[i];
+        c->kids[i]->ref++;
+      } else if (!n->shift && n->vals[i]) {
+        c->vals[i] = lval_ref(n->vals[i]);
+      }
+    }
+    n->ref--;
+    n = c;
+  }
+
+  int k = (t >> n->shift) & LVEC_MASK;
+  if (!n->shift) {
+    if (n->vals[k]) {
+      lval_del(n->vals[k]);
+    }
+    n->vals[k] = x;
+  } else {
+    if (!n->kids[k]) {
+      n->kids[k] = lvnode_new(n->shift - LVEC_BITS);
+    }
+    n->kids[k] = lvnode_set(n->kids[k], t, x);
+  }
+  return n;
+}
+
+lval*
+lval_nums(int count, int flt)
+{
+  lval* v = new_lval(LPOOL_SEQ);
+  v->type = LVAL_NUMS;
+  v->nums = lnums_new(count, flt);
+  v->count = count;
+  return v;
+}
+
+/* the elements of a numeric array as doubles, sharing its buffer when
+ * they already are */
+lnums*
+lnums_flt(lval *v)
+{
+  if (v->nums->flt) {
+    v->nums->ref++;
+    return v->nums;
+  }
+  lnums *n = lnums_new(v->count, 1);
+  for (int i = 0; i < v->count; i++) {
+    lnums_flts(n)[i] = v->nums->ints[i];
+  }
+  return n;
+}
+
+lval*
+lval_vec(void)
+{
+  lval* v = new_lval(LPOOL_SEQ);
+  v->type = LVAL_VEC;
+  return v;
+}
+
+/* value at index i of a vector, borrowed */
+lval*
+lvec_get(lval *v, int i)
+{
+  int t = v->off + i;
+  lvnode *n = v->root;
+  while (n->shift) {
+    n = n->kids[(t >> n->shift) & LVEC_MASK];
+  }
+  return n->vals[t & LVEC_MASK];
+}
+
+/* sets index i of a vector to x, i may be one past the end. Like
+ * lval_add it changes v in place, callers lval_own it first */
+lval*
+lvec_set(lval *v, int i, lval *x)
+{
+  long t = (long)v->off + i;
+  if (!v->root) {
+    v->root = lvnode_new(0);
+  }
+  while (t >> (v->root->shift + LVEC_BITS)) {
+    lvnode *r = lvnode_new(v->root->shift + LVEC_BITS);
+    r->kids[0] = v->root;
+    v->root = r;
+  }
+  v->root = lvnode_set(v->root, t, x);
+  if (i == v->count) {
+    v->count++;
+  }
+  return v;
+}
+
+/* values from up to to of a vector, sharing its trie */
+lval*
+lvec_slice(lval *v, int from, int to)
+{
+  v = lval_own(v);
+  v->off += from;
+  v->count = to - from;
+  if (!v->count) {
+    lvnode_del(v->root);
+    v->root = NULL;
+    v->off = 0;
+  }
+  return v;
+}
+
+static inline unsigned long
+lhash_mix(unsigned long h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdUL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53UL;
+  h ^= h >> 33;
+  return h;
+}
+
+/* map keys are strings, symbols and numbers */
+static inline int
+lval_hashable(lval *k)
+{
+  return k->type == LVAL_STR || k->type == LVAL_SYM || LVAL_IS_NUMBER(k);
+}
+
+/* hash of a map key, keys lval_eq finds equal hash the same */
+unsigned long
+lval_hash(lval *k)
+{
+  unsigned long h = 0;
+  switch (k->type) {
+  case LVAL_STR:
+    lstr(k);
+    h = lsym_hash(k->sym, k->slen);
+    break;
+  case LVAL_SYM:
+    h = (unsigned long)k->sym;
+    break;
+  case LVAL_NUM:
+    h = k->num;
+    break;
+  case LVAL_BIG:
+    h = k->big->neg;
+    for (int i = 0; i < k->big->len; i++) {
+      h = lhash_mix(h ^ k->big->d[i]);
+    }
+    break;
+  case LVAL_FNUM:
+    /* -0.0 equals 0.0 */
+    if (k->fnum != 0) {
+      memcpy(&h, &k->fnum, sizeof(h));
+    }
+    break;
+  }
+  return lhash_mix(h ^ k->type);
+}
+
+static inline int
+lhnode_index(lhnode *n, unsigned bit)
+{
+  return __builtin_popcount(n->bitmap & (bit - 1));
+}
+
+void
+lhslot_del(lhslot *s)
+{
+  if (s->key) {
+    lval_del(s->key);
+    lval_del(s->val);
+  } else {
+    lhnode_del(s->node);
+  }
+}
+
+/* n with a free slot at i when grow is 1, without slot i when it is -1,
+ * or only made unshared when it is 0. Takes over the caller's reference
+ * to n */
+lhnode*
+lhnode_resize(lhnode *n, int i, int grow)
+{
+  if (!grow && n->ref == 1) {
+    return n;
+  }
+  int skip = grow < 0;
+  lhnode *c = lhnode_new(n->count + grow);
+  c->bitmap = n->bitmap;
+  memcpy(c->slots, n->slots, sizeof(lhslot) * i);
+  memcpy(c->slots + i + (grow > 0), n->slots + i + skip, sizeof(lhslot) * (n->count - i - skip));
+
+  if (n->ref > 1) {
+    for (int j = 0; j < c->count; j++) {
+      if (grow > 0 && j == i) {
+        continue;
+      }
+      if (c->slots[j].key) {
+        lval_ref(c->slots[j].key);
+        lval_ref(c->slots[j].val);
+      } else {
+        c->slots[j].node->ref++;
+      }
+    }
+    n->ref--;
+  } else {
+    if (skip) {
+      lhslot_del(&n->slots[i]);
+    }
+    lfree(n, sizeof(lhnode) + sizeof(lhslot) * n->count);
+  }
+  return c;
+}
+
+/* value of k below n, borrowed, NULL when it is not there */
+lval*
+lhnode_get(lhnode *n, unsigned long h, lval *k)
+{
+  for (int shift = 0; n; shift += LMAP_BITS) {
+    if (shift >= LHASH_BITS) {
+      for (int i = 0; i < n->count; i++) {
+        if (lval_eq(n->slots[i].key, k)) {
+          return n->slots[i].val;
+        }
+      }
+      return NULL;
+    }
+    unsigned bit = 1u << ((h >> shift) & LMAP_MASK);
+    if (!(n->bitmap & bit)) {
+      return NULL;
+    }
+    lhslot *s = &n->slots[lhnode_index(n, bit)];
+    if (s->key) {
+      return lval_eq(s->key, k) ? s->val : NULL;
+    }
+    n = s->node;
+  }
+  return NULL;
+}
+
+/* puts k and v below n, which may be NULL, taking over the references to
+ * all three and returning the node replacing n. Sets *added unless k was
+ * there already */
+lhnode*
+lhnode_put(lhnode *n, unsigned long h, int shift, lval *k, lval *v, int *added)
+{
+  if (!n) {
+    n = lhnode_new(0);
+  }
+  if (shift >= LHASH_BITS) {
+    for (int i = 0; i < n->count; i++) {
+      if (lval_eq(n->slots[i].key, k)) {
+        n = lhnode_resize(n, 0, 0);
+        lval_del(k);
+        lval_del(n->slots[i].val);
+        n->slots[i].val = v;
+        return n;
+      }
+    }
+    n = lhnode_resize(n, n->count, 1);
+    n->slots[n->count - 1].key = k;
+    n->slots[n->count - 1].val = v;
+    *added = 1;
+    return n;
+  }
+
+  unsigned bit = 1u << ((h >> shift) & LMAP_MASK);
+  int i = lhnode_index(n, bit);
+  if (!(n->bitmap & bit)) {
+    n = lhnode_resize(n, i, 1);
+    n->bitmap |= bit;
+    n->slots[i].key = k;
+    n->slots[i].val = v;
+    *added = 1;
+    return n;
+  }
+
+  n = lhnode_resize(n, 0, 0);
+  lhslot *s = &n->slots[i];
+  if (!s->key) {
+    s->node = lhnode_put(s->node, h, shift + LMAP_BITS, k, v, added);
+  } else if (lval_eq(s->key, k)) {
+    lval_del(k);
+    lval_del(s->val);
+    s->val = v;
+  } else {
+    /* two keys share the fragment, both move a level down */
+    lhnode *c = lhnode_put(NULL, lval_hash(s->key), shift + LMAP_BITS, s->key, s->val, added);
+    s->key = NULL;
+    s->node = lhnode_put(c, h, shift + LMAP_BITS, k, v, added);
+  }
+  return n;
+}
+
+/* removes k, which has to be there, returning the node replacing n or
+ * NULL once n is empty */
+lhnode*
+lhnode_remove(lhnode *n, unsigned long h, int shift, lval *k)
+{
+  unsigned bit = 0;
+  int i = 0;
+  if (shift >= LHASH_BITS) {
+    while (!lval_eq(n->slots[i].key, k)) {
+      i++;
+    }
+  } else {
+    bit = 1u << ((h >> shift) & LMAP_MASK);
+    i = lhnode_index(n, bit);
+    if (!n->slots[i].key) {
+      n = lhnode_resize(n, 0, 0);
+      n->slots[i].node = lhnode_remove(n->slots[i].node, h, shift + LMAP_BITS, k);
+      if (n->slots[i].node) {
+        return n;
+      }
+    }
+  }
+
+  n = lhnode_resize(n, i, -1);
+  n->bitmap &= ~bit;
+  if (!n->count) {
+    lhnode_del(n);
+    return NULL;
+  }
+  return n;
+}
+
+/* adds every key below n to q, each followed by its value when vals */
+void
+lhnode_list(lhnode *n, lval *q, int vals)
+{
+  if (!n) {
+    return;
+  }
+  for (int i = 0; i < n->count; i++) {
+    if (!n->slots[i].key) {
+      lhnode_list(n->slots[i].node, q, vals);
+      continue;
+    }
+    lval_add(q, lval_ref(n->slots[i].key));
+    if (vals) {
+      lval_add(q, lval_ref(n->slots[i].val));
+    }
+  }
+}
+
+lval*
+lval_hmap(void)
+{
+  lval* v = new_lval(LPOOL_SEQ);
+  v->type = LVAL_MAP;
+  return v;
+}
+
+/* value of k in map m, borrowed, NULL when missing */
+lval*
+lhmap_get(lval *m, lval *k)
+{
+  return lhnode_get(m->hroot, lval_hash(k), k);
+}
+
+/* puts k and v into map m. Like lval_add it changes m in place, callers
+ * lval_own it first */
+lval*
+lhmap_put(lval *m, lval *k, lval *v)
+{
+  int added = 0;
+  m->hroot = lhnode_put(m->hroot, lval_hash(k), 0, k, v, &added);
+  m->count += added;
+  return m;
+}
+
+lval*
+lhmap_del(lval *m, lval *k)
+{
+  unsigned long h = lval_hash(k);
+  if (lhnode_get(m->hroot, h, k)) {
+    m->hroot = lhnode_remove(m->hroot, h, 0, k);
+    m->count--;
+  }
+  return m;
+}
+
+/* puts the bindings captured by partial application into a call frame,
+ * oldest first so slots follow the order of the formals */
+void
+lenv_put_captured(lenv *frame, lenv *c)
+{
+  if (!c) {
+    return;
+  }
+  lenv_put_captured(frame, c->parent);
+  for (int i = 0; i < c->count; i++) {
+    lenv_put_sym(frame, c->syms[i], c->vals[i]);
+  }
+}
+
+/* Binds the arguments of a call to the lambda f into a new activation
+ * frame. Once every formal is bound the frame is returned, its parent
+ * being the caller's env e. Otherwise NULL is returned and *r is set to
+ * the partially applied function or an error.
+ *
+ * Formals are walked by index, f is never modified so calling it needs
+ * no copy. A partial application keeps the bindings made so far in a
+ * frame pointing at the env f captured; that chain is only flattened
+ * when the call finally happens. */
+lenv*
+lval_bind(lenv* e, lval* f, lval *a, lval **r)
+{
+  lval *formals = f->formals;
+  lenv *frame = lenv_new();
+  int i = 0;
+
+  for (int j = 0; j < a->count; j++) {
+    if (i == formals->count) {
+      lenv_del(frame);
+      *r = lval_err("Function passed too many arguments: Got: %i, Expected: %i.", formals->count, a->count);
+      lval_del(a);
+      return NULL;
+    }
+    
+    lval* sym = formals->cell[i++];
+
+    if (sym->sym == lsym_amp) {
+      // variable arguments
+      if (i != formals->count - 1) {
+        lenv_del(frame);
+        lval_del(a);
+        *r = lval_err("Function format invalid. "
+                      "Symbol '&' not followed by single symbol.");
+        return NULL;
+      }
+      lval *rest = lval_slice(lval_ref(a), j, a->count);
+      rest->type = LVAL_QEXPR;
+      lenv_put(frame, formals->cell[i++], rest);
+      lval_del(rest);
+      break;
+    }
+
+    lenv_put(frame, sym, a->cell[j]);
+  }
+
+  lval_del(a);
+
+  /* if use doesnt support any variable arguments, assign empty list to the symbol after & */
+  if (i < formals->count && formals->cell[i]->sym == lsym_amp) {
+    if (i != formals->count - 2) {
+      lenv_del(frame);
+      *r = lval_err("Function format invalid. "
+                    "Symbol '&' not followed by single symbol.");
+      return NULL;
+    }
+
+    lval *val = lval_qexpr();
+    lenv_put(frame, formals->cell[i + 1], val);
+    lval_del(val);
+    i += 2;
+  }
+
+  if (i < formals->count) {
+    lval *rest = lval_slice(lval_ref(formals), i, formals->count);
+    frame->parent = f->env ? lenv_ref(f->env) : NULL;
+    *r = lval_lambda(rest, lval_ref(f->body));
+    (*r)->env = frame;
+    return NULL;
+  }
+
+  if (f->env) {
+    lenv *act = lenv_new();
+    int cap = frame->count;
+    for (lenv *c = f->env; c; c = c->parent) {
+      cap += c->count;
+    }
+    act->vals = lalloc(sizeof(lval *) * cap);
+    act->syms = lalloc(sizeof(char *) * cap);
+    act->cap = cap;
+    lenv_put_captured(act, f->env);
+    for (int k = 0; k < frame->count; k++) {
+      lenv_put_sym(act, frame->syms[k], frame->vals[k]);
+    }
+    lenv_del(frame);
+    frame = act;
+  }
+  frame->parent = lenv_ref(e);
+  return frame;
+}
+
+/* arithmetic operators, indexing the table of their binary forms */
+enum { LARITH_ADD, LARITH_SUB, LARITH_MUL, LARITH_DIV, LARITH_MOD, LARITH_MIN, LARITH_MAX, LARITH_POW };
+
+/* Magnitudes are arrays of limbs, lowest first. The helpers below leave
+ * lengths to their callers, lmag_len trims the zero limbs on top. */
+static inline int
+lmag_len(const unsigned *a, int n)
+{
+  while (n && !a[n - 1]) {
+    n--;
+  }
+  return n;
+}
+
+static int
+lmag_cmp(const unsigned *a, int an, const unsigned *b, int bn)
+{
+  if (an != bn) {
+    return an < bn ? -1 : 1;
+  }
+  for (int i = an - 1; i >= 0; i--) {
+    if (a[i] != b[i]) {
+      return a[i] < b[i] ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+/* r += a, r has room for the carry */
+static void
+lmag_addto(unsigned *r, int rn, const unsigned *a, int an)
+{
+  unsigned long c = 0;
+  int i = 0;
+  for (; i < an; i++) {
+    c += (unsigned long)r[i] + a[i];
+    r[i] = c;
+    c >>= 32;
+  }
+  for (; c && i < rn; i++) {
+    c += r[i];
+    r[i] = c;
+    c >>= 32;
+  }
+}
+
+/* r -= a, r is not smaller than a */
+static void
+lmag_subfrom(unsigned *r, int rn, const unsigned *a, int an)
+{
+  unsigned long b = 0;
+  int i = 0;
+  for (; i < an; i++) {
+    unsigned long t = (unsigned long)r[i] - a[i] - b;
+    r[i] = t;
+    b = (t >> 32) & 1;
+  }
+  for (; b && i < rn; i++) {
+    unsigned long t = (unsigned long)r[i] - b;
+    r[i] = t;
+    b = (t >> 32) & 1;
+  }
+}
+
+/* a = a * m + c, returning the new length, a has room for one more limb */
+static int
+lmag_muladd(unsigned *a, int an, unsigned m, unsigned c)
+{
+  unsigned long t = c;
+  for (int i = 0; i < an; i++) {
+    t += (unsigned long)a[i] * m;
+    a[i] = t;
+    t >>= 32;
+  }
+  if (t) {
+    a[an++] = t;
+  }
+  return an;
+}
+
+/* q = a / d, returning a % d */
+static unsigned
+lmag_divsmall(unsigned *q, const unsigned *a, int an, unsigned d)
+{
+  unsigned long r = 0;
+  for (int i = an - 1; i >= 0; i--) {
+    r = (r << 32) | a[i];
+    q[i] = r / d;
+    r %= d;
+  }
+  return r;
+}
+
+/* r = a * b, r is an + bn zeroed limbs. Karatsuba splits both at m limbs
+ * and gets by with three half size products: a0 b0, a1 b1 and
+ * (a0 + a1)(b0 + b1), the middle term being the last minus the others */
+static void
+lmag_mul(unsigned *r, const unsigned *a, int an, const unsigned *b, int bn)
+{
+  if (an < bn) {
+    const unsigned *t = a;
+    a = b;
+    b = t;
+    int tn = an;
+    an = bn;
+    bn = tn;
+  }
+  if (bn < LBIG_KARATSUBA) {
+    for (int i = 0; i < bn; i++) {
+      unsigned long c = 0;
+      for (int j = 0; b[i] && j < an; j++) {
+        c += (unsigned long)a[j] * b[i] + r[i + j];
+        r[i + j] = c;
+        c >>= 32;
+      }
+      r[i + an] = c;
+    }
+    return;
+  }
+
+  /* unbalanced, a piece of a as long as b at a time */
+  if (an >= 2 * bn) {
+    unsigned *t = lalloc(sizeof(unsigned) * 2 * bn);
+    for (int i = 0; i < an; i += bn) {
+      int k = an - i < bn ? an - i : bn;
+      bzero(t, sizeof(unsigned) * (k + bn));
+      lmag_mul(t, a + i, k, b, bn);
+      lmag_addto(r + i, an + bn - i, t, k + bn);
+    }
+    lfree(t, sizeof(unsigned) * 2 * bn);
+    return;
+  }
+
+  int m = an / 2;
+  int a1n = an - m, b1n = bn - m;
+  lmag_mul(r, a, m, b, m);
+  lmag_mul(r + 2 * m, a + m, a1n, b + m, b1n);
+
+  int sn = (m > b1n ? m : b1n) + 1;
+  size_t size = sizeof(unsigned) * 2 * (a1n + 1 + sn);
+  unsigned *sa = lalloc(size), *sb = sa + a1n + 1, *z1 = sb + sn;
+  memcpy(sa, a + m, sizeof(unsigned) * a1n);
+  sa[a1n] = 0;
+  lmag_addto(sa, a1n + 1, a, m);
+  bzero(sb, sizeof(unsigned) * sn);
+  memcpy(sb, b, sizeof(unsigned) * m);
+  lmag_addto(sb, sn, b + m, b1n);
+  int san = lmag_len(sa, a1n + 1), sbn = lmag_len(sb, sn);
+  bzero(z1, sizeof(unsigned) * (san + sbn));
+  lmag_mul(z1, sa, san, sb, sbn);
+  int z1n = lmag_len(z1, san + sbn);
+  lmag_subfrom(z1, z1n, r, lmag_len(r, 2 * m));
+  lmag_subfrom(z1, z1n, r + 2 * m, lmag_len(r + 2 * m, an + bn - 2 * m));
+  lmag_addto(r + m, an + bn - m, z1, lmag_len(z1, z1n));
+  lfree(sa, size);
+}
+
+/* q = a / b and r = a % b for b of two limbs or more, Knuth's algorithm D
+ * as in Hacker's Delight: each quotient limb is estimated from the top
+ * limbs, off by at most one after the correction loop, and fixed up by
+ * adding b back when the subtraction went negative */
+static void
+lmag_divmod(unsigned *q, unsigned *r, const unsigned *a, int an, const unsigned *b, int bn)
+{
+  int s = __builtin_clz(b[bn - 1]);
+  size_t size = sizeof(unsigned) * (an + 1 + bn);
+  unsigned *u = lalloc(size), *v = u + an + 1;
+  for (int i = bn - 1; i > 0; i--) {
+    v[i] = (b[i] << s) | (s ? b[i - 1] >> (32 - s) : 0);
+  }
+  v[0] = b[0] << s;
+  u[an] = s ? a[an - 1] >> (32 - s) : 0;
+  for (int i = an - 1; i > 0; i--) {
+    u[i] = (a[i] << s) | (s ? a[i - 1] >> (32 - s) : 0);
+  }
+  u[0] = a[0] << s;
+
+  for (int j = an - bn; j >= 0; j--) {
+    unsigned long n = ((unsigned long)u[j + bn] << 32) | u[j + bn - 1];
+    unsigned long qh = n / v[bn - 1], rh = n % v[bn - 1];
+    while (qh >> 32 || qh * v[bn - 2] > ((rh << 32) | u[j + bn - 2])) {
+      qh--;
+      rh += v[bn - 1];
+      if (rh >> 32) {
+        break;
+      }
+    }
+    long k = 0, t;
+    for (int i = 0; i < bn; i++) {
+      unsigned long p = qh * v[i];
+      t = (long)u[i + j] - k - (long)(p & 0xffffffff);
+      u[i + j] = t;
+      k = (long)(p >> 32) - (t >> 32);
+    }
+    t = (long)u[j + bn] - k;
+    u[j + bn] = t;
+    q[j] = qh;
+    if (t < 0) {
+      q[j]--;
+      unsigned long c = 0;
+      for (int i = 0; i < bn; i++) {
+        c += (unsigned long)u[i + j] + v[i];
+        u[i + j] = c;
+        c >>= 32;
+      }
+      u[j + bn] += c;
+    }
+  }
+  for (int i = 0; i < bn; i++) {
+    r[i] = (u[i] >> s) | (s ? (unsigned long)u[i + 1] << (32 - s) : 0);
+  }
+  lfree(u, size);
+}
+
+/* the value of a magnitude when it fits a long */
+static int
+lmag_long(const unsigned *d, int len, int neg, long *x)
+{
+  if (len > 2) {
+    return 0;
+  }
+  unsigned long m = len == 0 ? 0 : len == 1 ? d[0] : ((unsigned long)d[1] << 32) | d[0];
+  if (m > (unsigned long)LONG_MAX + neg) {
+    return 0;
+  }
+  *x = neg ? (long)(0 - m) : (long)m;
+  return 1;
+}
+
+/* the number for a finished result, a plain one when it fits a long */
+lval*
+lval_big(lbig *b)
+{
+  long x;
+  b->len = lmag_len(b->d, b->len);
+  if (lmag_long(b->d, b->len, b->neg, &x)) {
+    lbig_del(b);
+    return lval_num(x);
+  }
+  if (b->len > LBIG_MAX_LIMBS) {
+    lbig_del(b);
+    return lval_err("integer too big.");
+  }
+  lval *v = new_lval(LPOOL_SCALAR);
+  v->type = LVAL_BIG;
+  v->big = b;
+  return v;
+}
+
+/* the limbs of an integer, plain numbers borrow the two in tmp */
+typedef struct {
+  const unsigned *d;
+  int len;
+  int neg;
+  unsigned tmp[2];
+} lbigv;
+
+static void
+lbig_view(lval *x, lbigv *v)
+{
+  if (x->type == LVAL_BIG) {
+    v->d = x->big->d;
+    v->len = x->big->len;
+    v->neg = x->big->neg;
+    return;
+  }
+  unsigned long m = x->num < 0 ? 0 - (unsigned long)x->num : (unsigned long)x->num;
+  v->tmp[0] = m;
+  v->tmp[1] = m >> 32;
+  v->d = v->tmp;
+  v->len = lmag_len(v->tmp, 2);
+  v->neg = x->num < 0;
+}
+
+double
+lbig_double(lval *v)
+{
+  double f = 0;
+  for (int i = v->big->len - 1; i >= 0; i--) {
+    f = f * 4294967296.0 + v->big->d[i];
+  }
+  return v->big->neg ? -f : f;
+}
+
+/* x against y, integers of either kind */
+int
+lnum_cmp(lval *x, lval *y)
+{
+  if (x->type == LVAL_NUM && y->type == LVAL_NUM) {
+    return (x->num > y->num) - (x->num < y->num);
+  }
+  lbigv a, b;
+  lbig_view(x, &a);
+  lbig_view(y, &b);
+  if (a.neg != b.neg) {
+    return a.neg ? -1 : 1;
+  }
+  int c = lmag_cmp(a.d, a.len, b.d, b.len);
+  return a.neg ? -c : c;
+}
+
+/* exact arithmetic on integers of either kind, for when a long overflows
+ * or an operand is a bignum already. y is not 0 for LARITH_DIV and
+ * LARITH_MOD */
+lval*
+lbig_arith(int op, lval *x, lval *y)
+{
+  lbigv a, b;
+  lbig_view(x, &a);
+  lbig_view(y, &b);
+  if ((long)a.len + b.len > LBIG_MAX_LIMBS) {
+    return lval_err("integer too big.");
+  }
+
+  lbig *r;
+  switch (op) {
+  case LARITH_ADD:
+  case LARITH_SUB: {
+    int bneg = b.neg ^ (op == LARITH_SUB);
+    int c = lmag_cmp(a.d, a.len, b.d, b.len);
+    lbigv *big = c >= 0 ? &a : &b, *small = c >= 0 ? &b : &a;
+    r = lbig_new(big->len + 1);
+    memcpy(r->d, big->d, sizeof(unsigned) * big->len);
+    if (a.neg == bneg) {
+      lmag_addto(r->d, r->len, small->d, small->len);
+      r->neg = a.neg;
+    } else {
+      lmag_subfrom(r->d, r->len, small->d, small->len);
+      r->neg = c >= 0 ? a.neg : bneg;
+    }
+    break;
+  }
+  case LARITH_MUL:
+    r = lbig_new(a.len + b.len);
+    lmag_mul(r->d, a.d, a.len, b.d, b.len);
+    r->neg = a.neg ^ b.neg;
+    break;
+  case LARITH_DIV:
+  case LARITH_MOD: {
+    /* truncated like C's, the remainder takes the sign of x */
+    lbig *q = lbig_new(a.len), *m = lbig_new(b.len);
+    if (lmag_cmp(a.d, a.len, b.d, b.len) < 0) {
+      memcpy(m->d, a.d, sizeof(unsigned) * a.len);
+    } else if (b.len == 1) {
+      m->d[0] = lmag_divsmall(q->d, a.d, a.len, b.d[0]);
+    } else {
+      lmag_divmod(q->d, m->d, a.d, a.len, b.d, b.len);
+    }
+    q->neg = a.neg ^ b.neg;
+    m->neg = a.neg;
+    if (op == LARITH_DIV) {
+      lbig_del(m);
+      r = q;
+    } else {
+      lbig_del(q);
+      r = m;
+    }
+    break;
+  }
+  default:
+    return lval_err("invalid op");
+  }
+  return lval_big(r);
+}
+
+/* an integer literal too long for a long */
+lval*
+lval_read_big(const char *s)
+{
+  int neg = *s == '-';
+  s += neg;
+  int n = strlen(s);
+  lbig *b = lbig_new(n / 9 + 2);
+  int len = 0;
+  for (int i = 0; i < n; ) {
+    unsigned chunk = 0, scale = 1;
+    for (int k = 0; k < 9 && i < n; k++, i++) {
+      chunk = chunk * 10 + (s[i] - '0');
+      scale *= 10;
+    }
+    len = lmag_muladd(b->d, len, scale, chunk);
+  }
+  b->neg = neg;
+  return lval_big(b);
+}
+
+/* decimal digits, nine at a time from the bottom by dividing by 10^9 */
+void
+lval_big_print(lval *v)
+{
+  int len = v->big->len;
+  size_t size = sizeof(unsigned) * (len + len * 10 / 9 + 2);
+  unsigned *q = lalloc(size), *parts = q + len;
+  int n = 0;
+  memcpy(q, v->big->d, sizeof(unsigned) * len);
+  while (len) {
+    parts[n++] = lmag_divsmall(q, q, len, 1000000000);
+    len = lmag_len(q, len);
+  }
+  printf("%s%u", v->big->neg ? "-" : "", parts[n - 1]);
+  for (int i = n - 2; i >= 0; i--) {
+    printf("%09u", parts[i]);
+  }
+  lfree(q, size);
+}
+
+lval*
+eval_add(lval *x, lval *y)
+{
+  if (x->type == LVAL_FNUM || y->type == LVAL_FNUM) {
+    // float
+    return lval_fnum(EXTRACT_FNUM(x) + EXTRACT_FNUM(y));
+  }
+  long r;
+  if (x->type == LVAL_NUM && y->type == LVAL_NUM && !__builtin_add_overflow(x->num, y->num, &r)) {
+    return lval_num(r);
+  }
+  return lbig_arith(LARITH_ADD, x, y);
+}
+
+lval*
+eval_minus(lval *x, lval *y)
+{
+  if (x->type == LVAL_FNUM || y->type == LVAL_FNUM) {
+    // float
+    return lval_fnum(EXTRACT_FNUM(x) - EXTRACT_FNUM(y));
+  }
+  long r;
+  if (x->type == LVAL_NUM && y->type == LVAL_NUM && !__builtin_sub_overflow(x->num, y->num, &r)) {
+    return lval_num(r);
+  }
+  return lbig_arith(LARITH_SUB, x, y);
+}
+
+lval*
+eval_mod(lval *x, lval *y) {
+  if (x->type == LVAL_FNUM || y->type == LVAL_FNUM) {
+    // float
+    return lval_err("float modulo.");
+  }
+  if (y->type == LVAL_NUM && y->num == 0) {
+    return lval_err("Division by zero.");
+  }
+  if (y->type == LVAL_NUM && y->num == -1) {
+    return lval_num(0);
+  }
+  if (x->type == LVAL_NUM && y->type == LVAL_NUM) {
+    return lval_num(x->num % y->num);
+  }
+  return lbig_arith(LARITH_MOD, x, y);
+}
+
+lval*
+eval_mul(lval *x, lval *y) {
+  if (x->type == LVAL_FNUM || y->type == LVAL_FNUM) {
+    // float
+    return lval_fnum(EXTRACT_FNUM(x) * EXTRACT_FNUM(y));
+  }
+  long r;
+  if (x->type == LVAL_NUM && y->type == LVAL_NUM && !__builtin_mul_overflow(x->num, y->num, &r)) {
+    return lval_num(r);
+  }
+  return lbig_arith(LARITH_MUL, x, y);
+}
+
+lval*
+eval_div(lval *x, lval *y) {
+  if (EXTRACT_VALUE(y) == 0) {
+    return lval_err("Division by zero.");
+  }
+
+  if (x->type == LVAL_FNUM || y->type == LVAL_FNUM) {
+    // float
+    return lval_fnum(EXTRACT_FNUM(x) / EXTRACT_FNUM(y));
+  }
+  if (x->type == LVAL_NUM && y->type == LVAL_NUM && !(x->num == LONG_MIN && y->num == -1)) {
+    return lval_num(x->num / y->num);
+  }
+  return lbig_arith(LARITH_DIV, x, y);
+}
+
+lval*
+eval_min(lval *x, lval *y) {
+  if (x->type == LVAL_FNUM || y->type == LVAL_FNUM) {
+    // float
+    return lval_fnum(EXTRACT_VALUE(x) < EXTRACT_VALUE(y) ? EXTRACT_VALUE(x) : EXTRACT_VALUE(y));
+  }
+  return lval_ref(lnum_cmp(x, y) <= 0 ? x : y);
+}
+
+lval*
+eval_max(lval *x, lval *y) {
+  if (x->type == LVAL_FNUM || y->type == LVAL_FNUM) {
+    // float
+    return lval_fnum(EXTRACT_VALUE(x) > EXTRACT_VALUE(y) ? EXTRACT_VALUE(x) : EXTRACT_VALUE(y));
+  }
+  return lval_ref(lnum_cmp(x, y) >= 0 ? x : y);
+}
+
+lval*
+eval_pow(lval *x, lval *y)
+{
+  if (x->type == LVAL_FNUM || y->type == LVAL_FNUM) {
+    // float
+    return lval_fnum(powl(EXTRACT_FNUM(x), EXTRACT_FNUM(y)));
+  }
+
+  /* integer powers are exact, by squaring */
+  lbigv a;
+  lbig_view(x, &a);
+  int unit = a.len == 0 || (a.len == 1 && a.d[0] == 1);
+  if (y->type == LVAL_BIG && !y->big->neg) {
+    if (!unit) {
+      return lval_err("integer too big.");
+    }
+    return lval_num(a.len && a.neg && (y->big->d[0] & 1) ? -1 : a.len);
+  }
+  if (y->type == LVAL_BIG || y->num < 0) {
+    /* a negative power is a fraction, so it goes the float way */
+    return lval_fnum(powl(EXTRACT_FNUM(x), EXTRACT_FNUM(y)));
+  }
+  long bits = a.len ? 32 * a.len - __builtin_clz(a.d[a.len - 1]) : 0;
+  if (!unit && (double)bits * y->num > 32.0 * LBIG_MAX_LIMBS) {
+    return lval_err("integer too big.");
+  }
+  lval *r = lval_num(1), *b = lval_ref(x);
+  for (long e = y->num; e; e >>= 1) {
+    if (e & 1) {
+      lval *t = eval_mul(r, b);
+      lval_del(r);
+      r = t;
+    }
+    if (e > 1) {
+      lval *t = eval_mul(b, b);
+      lval_del(b);
+      b = t;
+    }
+  }
+  lval_del(b);
+  return r;
+}
+
+typedef lval *(*larith_fn)(lval*, lval*);
+
+static const larith_fn larith_ops[] = {
+  [LARITH_ADD] = eval_add,
+  [LARITH_SUB] = eval_minus,
+  [LARITH_MUL] = eval_mul,
+  [LARITH_DIV] = eval_div,
+  [LARITH_MOD] = eval_mod,
+  [LARITH_MIN] = eval_min,
+  [LARITH_MAX] = eval_max,
+  [LARITH_POW] = eval_pow,
+};
+
+/* Kernels over numeric arrays, written with vector extensions four lanes
+ * wide. The same code is built for AVX2 and for the baseline, where the
+ * compiler splits each operation in SSE2 halves. Sums of doubles are added
+ * lane by lane. Integers are computed as machine words and each kernel
+ * returns nonzero when one may have overflowed, so the caller can redo the
+ * work exactly; a false alarm only costs that slower path. */
+typedef unsigned long lnv_int __attribute__((vector_size(32), aligned(8), may_alias));
+typedef double lnv_flt __attribute__((vector_size(32), aligned(8), may_alias));
+#define LNV_LANES 4
+
+/* the sign bit is set where x op y = r went past a machine word */
+#define LOVF_ADD(x, y, r) (((x) ^ (r)) & ((y) ^ (r)))
+#define LOVF_SUB(x, y, r) (((x) ^ (y)) & ((x) ^ (r)))
+/* below 2^k when x is within [-2^k, 2^k) */
+#define LMAG(x) ((x) ^ -((x) >> 63))
+/* bits needed by the magnitudes gathered in m */
+#define LMAG_BITS(m) (64 - __builtin_clzl((m) | 1))
+
+/* o = a op b elementwise, b is a single value when bcast is set */
+#define LNUMS_ZIP(V, OP)                                        \
+  for (; i + LNV_LANES <= n; i += LNV_LANES) {                  \
+    V w = {b[0], b[0], b[0], b[0]};                             \
+    if (!bcast) {                                               \
+      w = *(const V*)(b + i);                                   \
+    }                                                           \
+    *(V*)(o + i) = *(const V*)(a + i) OP w;                     \
+  }                                                             \
+  for (; i < n; i++) {                                          \
+    o[i] = a[i] OP b[bcast ? 0 : i];                            \
+  }
+
+/* the same over integers, gathering the overflow bits in ovf */
+#define LNUMS_ZIP_INT(OP, OVF)                                  \
+  do {                                                          \
+    lnv_int m = {0, 0, 0, 0};                                   \
+    for (; i + LNV_LANES <= n; i += LNV_LANES) {                \
+      lnv_int w = {b[0], b[0], b[0], b[0]};                     \
+      if (!bcast) {                                             \
+        w = *(const lnv_int*)(b + i);                           \
+      }                                                         \
+      lnv_int u = *(const lnv_int*)(a + i), r = u OP w;         \
+      *(lnv_int*)(o + i) = r;                                   \
+      m |= OVF(u, w, r);                                        \
+    }                                                           \
+    ovf = m[0] | m[1] | m[2] | m[3];                            \
+    for (; i < n; i++) {                                        \
+      unsigned long u = a[i], w = b[bcast ? 0 : i];             \
+      o[i] = u OP w;                                            \
+      ovf |= OVF(u, w, o[i]);                                   \
+    }                                                           \
+    ovf >>= 63;                                                 \
+  } while (0)
+
+#define LNUMS_FOLD(T, V, OP, UNIT)                              \
+  do {                                                          \
+    V acc = {UNIT, UNIT, UNIT, UNIT};                           \
+    for (; i + LNV_LANES <= n; i += LNV_LANES) {                \
+      acc = acc OP *(const V*)(a + i);                          \
+    }                                                           \
+    T r = acc[0] OP acc[1] OP acc[2] OP acc[3];                 \
+    for (; i < n; i++) {                                        \
+      r = r OP a[i];                                            \
+    }                                                           \
+    memcpy(res, &r, sizeof(T));                                 \
+  } while (0)
+
+#define LNUMS_DOT(T, V)                                         \
+  do {                                                          \
+    V acc = {0, 0, 0, 0};                                       \
+    for (; i + LNV_LANES <= n; i += LNV_LANES) {                \
+      acc += *(const V*)(a + i) * *(const V*)(b + i);           \
+    }                                                           \
+    T r = acc[0] + acc[1] + acc[2] + acc[3];                    \
+    for (; i < n; i++) {                                        \
+      r += a[i] * b[i];                                         \
+    }                                                           \
+    memcpy(res, &r, sizeof(T));                                 \
+  } while (0)
+
+static inline __attribute__((always_inline)) int
+lnums_zip_k(int op, int flt, long n, long *out, const long *x, const long *y, int bcast)
+{
+  long i = 0;
+  unsigned long ovf = 0;
+  if (flt) {
+    double *o = (double*)out;
+    const double *a = (const double*)x, *b = (const double*)y;
+    switch (op) {
+    case LARITH_ADD: LNUMS_ZIP(lnv_flt, +); break;
+    case LARITH_SUB: LNUMS_ZIP(lnv_flt, -); break;
+    case LARITH_MUL: LNUMS_ZIP(lnv_flt, *); break;
+    }
+  } else {
+    unsigned long *o = (unsigned long*)out;
+    const unsigned long *a = (const unsigned long*)x, *b = (const unsigned long*)y;
+    switch (op) {
+    case LARITH_ADD: LNUMS_ZIP_INT(+, LOVF_ADD); break;
+    case LARITH_SUB: LNUMS_ZIP_INT(-, LOVF_SUB); break;
+    case LARITH_MUL: {
+      /* products of numbers that leave enough bits free cannot overflow,
+       * others are checked one by one */
+      lnv_int ma = {0, 0, 0, 0}, mb = {0, 0, 0, 0};
+      for (; i + LNV_LANES <= n; i += LNV_LANES) {
+        lnv_int w = {b[0], b[0], b[0], b[0]};
+        if (!bcast) {
+          w = *(const lnv_int*)(b + i);
+        }
+        lnv_int u = *(const lnv_int*)(a + i);
+        *(lnv_int*)(o + i) = u * w;
+        ma |= LMAG(u);
+        mb |= LMAG(w);
+      }
+      unsigned long fa = ma[0] | ma[1] | ma[2] | ma[3], fb = mb[0] | mb[1] | mb[2] | mb[3];
+      for (; i < n; i++) {
+        unsigned long w = b[bcast ? 0 : i];
+        o[i] = a[i] * w;
+        fa |= LMAG(a[i]);
+        fb |= LMAG(w);
+      }
+      if (LMAG_BITS(fa) + LMAG_BITS(fb) >= 63) {
+        for (i = 0; i < n; i++) {
+          ovf |= __builtin_mul_overflow(x[i], y[bcast ? 0 : i], &out[i]);
+        }
+      }
+      break;
+    }
+    }
+  }
+  return ovf != 0;
+}
+
+static inline __attribute__((always_inline)) int
+lnums_fold_k(int op, int flt, long n, const long *x, void *res)
+{
+  long i = 0;
+  if (flt) {
+    const double *a = (const double*)x;
+    if (op == LARITH_MUL) {
+      LNUMS_FOLD(double, lnv_flt, *, 1);
+    } else {
+      LNUMS_FOLD(double, lnv_flt, +, 0);
+    }
+    return 0;
+  }
+
+  int ovf = 0;
+  long r;
+  if (op == LARITH_MUL) {
+    for (r = 1; i < n && !ovf; i++) {
+      ovf = __builtin_mul_overflow(r, x[i], &r);
+    }
+  } else {
+    const unsigned long *a = (const unsigned long*)x;
+    lnv_int acc = {0, 0, 0, 0}, m = {0, 0, 0, 0};
+    for (; i + LNV_LANES <= n; i += LNV_LANES) {
+      lnv_int u = *(const lnv_int*)(a + i), t = acc + u;
+      m |= LOVF_ADD(acc, u, t);
+      acc = t;
+    }
+    ovf = __builtin_add_overflow((long)acc[0], (long)acc[1], &r);
+    ovf |= __builtin_add_overflow(r, (long)acc[2], &r);
+    ovf |= __builtin_add_overflow(r, (long)acc[3], &r);
+    for (; i < n; i++) {
+      ovf |= __builtin_add_overflow(r, x[i], &r);
+    }
+    ovf |= (m[0] | m[1] | m[2] | m[3]) >> 63;
+  }
+  memcpy(res, &r, sizeof(long));
+  return ovf;
+}
+
+static inline __attribute__((always_inline)) int
+lnums_dot_k(int flt, long n, const long *x, const long *y, void *res)
+{
+  long i = 0;
+  if (flt) {
+    const double *a = (const double*)x, *b = (const double*)y;
+    LNUMS_DOT(double, lnv_flt);
+    return 0;
+  }
+
+  /* as long as the magnitudes leave bits for the n products and their
+   * sum, the words cannot overflow; otherwise check every step */
+  const unsigned long *a = (const unsigned long*)x, *b = (const unsigned long*)y;
+  lnv_int acc = {0, 0, 0, 0}, ma = {0, 0, 0, 0}, mb = {0, 0, 0, 0};
+  for (; i + LNV_LANES <= n; i += LNV_LANES) {
+    lnv_int u = *(const lnv_int*)(a + i), w = *(const lnv_int*)(b + i);
+    acc += u * w;
+    ma |= LMAG(u);
+    mb |= LMAG(w);
+  }
+  unsigned long r = acc[0] + acc[1] + acc[2] + acc[3];
+  unsigned long fa = ma[0] | ma[1] | ma[2] | ma[3], fb = mb[0] | mb[1] | mb[2] | mb[3];
+  for (; i < n; i++) {
+    r += a[i] * b[i];
+    fa |= LMAG(a[i]);
+    fb |= LMAG(b[i]);
+  }
+
+  int ovf = 0;
+  if (LMAG_BITS(fa) + LMAG_BITS(fb) + LMAG_BITS((unsigned long)n) >= 63) {
+    long t = 0;
+    for (i = 0; i < n; i++) {
+      long p;
+      ovf |= __builtin_mul_overflow(x[i], y[i], &p);
+      ovf |= __builtin_add_overflow(t, p, &t);
+    }
+    r = t;
+  }
+  memcpy(res, &r, sizeof(long));
+  return ovf;
+}
+
+/* the entry points, each picking the AVX2 build of its kernel where the
+ * CPU has it */
+#ifdef LAVX2
+#define LNUMS_ENTRY(name, params, args)                         \
+  __attribute__((target("avx2"))) static int                    \
+  name##_avx2 params { return name##_k args; }                  \
+  static int                                                    \
+  name##_base params { return name##_k args; }                  \
+  int                                                           \
+  name params                                                   \
+  {                                                             \
+    if (__builtin_cpu_supports("avx2")) {                       \
+      return name##_avx2 args;                                  \
+    }                                                           \
+    return name##_base args;                                    \
+  }
+#else
+#define LNUMS_ENTRY(name, params, args)                         \
+  int                                                           \
+  name params { return name##_k args; }
+#endif
+
+LNUMS_ENTRY(lnums_zip, (int op, int flt, long n, long *out, const long *x, const long *y, int bcast),
+            (op, flt, n, out, x, y, bcast))
+LNUMS_ENTRY(lnums_fold, (int op, int flt, long n, const long *x, void *res), (op, flt, n, x, res))
+LNUMS_ENTRY(lnums_dot, (int flt, long n, const long *x, const long *y, void *res), (flt, n, x, y, res))
+
+lval*
+eval_unary(int op, lval *a)
+{
+  if (!LVAL_IS_NUMBER(a)) {
+    return lval_err("require a number"); 
+  }
+
+  int neg = op == LARITH_SUB;
+  if (!neg && op != LARITH_ADD) {
+    return lval_err("invalid expression");
+  }
+  if (a->type == LVAL_FNUM) {
+    return lval_fnum(neg ? -a->fnum : a->fnum);
+  }
+  if (!neg) {
+    return lval_ref(a);
+  }
+  if (a->type == LVAL_NUM && a->num != LONG_MIN) {
+    return lval_num(-a->num);
+  }
+  lval *zero = lval_num(0);
+  lval *r = lbig_arith(LARITH_SUB, zero, a);
+  lval_del(zero);
+  return r;
+}
+
+lval*
+builtin_head(lenv* e, lval *a)
+{
+  LASSERT_NUM("head", a, 1);
+  LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
+  LASSERT_EMPTY("head", a);
+
+  return lval_slice(lval_take(a, 0), 0, 1);
+}
+
+lval*
+builtin_tail(lenv* e, lval *a)
+{
+  LASSERT_NUM("tail", a, 1);
+  LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
+  LASSERT_EMPTY("tail", a);
+  
+  lval* v = lval_take(a, 0);
+  return lval_slice(v, 1, v->count);
+}
+
+lval*
+builtin_strtail(lenv* e, lval *a)
+{
+  LASSERT_NUM("strtail", a, 1);
+  LASSERT_TYPE("strtail", a, 0, LVAL_STR);
+  LASSERT_EMPTY("strtail", a);
+
+  lval *v = lval_take(a, 0);
+  lstr(v);
+  return lstr_slice(v, v->slen ? 1 : 0, v->slen);
+}
+
+lval*
+builtin_strjoin(lenv* e, lval *a)
+{
+  LASSERT_TYPE("strjoin", a, 0, LVAL_STR);
+  LASSERT_EMPTY("strjoin", a);
+
+  size_t length = 0;
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("strjoin", a, i, LVAL_STR);
+    lstr(a->cell[i]);
+    length += a->cell[i]->slen;
+  }
+  if (length < LSTR_SHARE_MIN) {
+    larena_mark m = larena_save(&scratch);
+    char *str = larena_alloc(&scratch, length+1);
+
+    size_t offset = 0;
+    for (int i = 0; i < a->count; i++) {
+      memcpy(str+offset, a->cell[i]->sym, a->cell[i]->slen);
+      offset += a->cell[i]->slen;
+    }
+
+    lval* v = lval_str_len(str, length);
+    larena_restore(&scratch, m);
+    lval_del(a);
+    return v;
+  }
+
+  /* Joins go into a heap buffer. When the first string ends where the
+   * bytes written to its buffer do, the rest is appended in place: no
+   * string sees past its own length, so none of them changes. Otherwise
+   * the first string is copied into a new buffer, with room to spare if
+   * it came from a join, making repeated joins onto a string linear. */
+  lval *x = a->cell[0];
+  lmap *m = x->map;
+  if (m && m->heap && x->sym + x->slen == m->data + m->used && length - x->slen <= m->len - m->used) {
+    m = lmap_ref(m);
+  } else {
+    m = lmap_new(NULL, m && m->heap ? length * 2 : length);
+    memcpy(m->data, x->sym, x->slen);
+    m->used = x->slen;
+  }
+
+  lval *v = new_lval(LPOOL_SEQ);
+  v->type = LVAL_STR;
+  v->map = m;
+  v->sym = m->data + m->used - x->slen;
+  v->slen = length;
+  for (int i = 1; i < a->count; i++) {
+    memcpy(m->data + m->used, a->cell[i]->sym, a->cell[i]->slen);
+    m->used += a->cell[i]->slen;
+  }
+  m->data[m->used] = 0;
+  lval_del(a);
+  return v;
+}
+
+lval*
+builtin_strhead(lenv* e, lval *a)
+{
+  LASSERT_NUM("strhead", a, 1);
+  LASSERT_TYPE("strhead", a, 0, LVAL_STR);
+  
+  lval *v = lval_take(a, 0);
+  lstr(v);
+  return lstr_slice(v, 0, v->slen ? 1 : 0);
+}
+
+lval*
+builtin_strfind(lenv* e, lval *a)
+{
+  LASSERT_NUM("str-find", a, 2);
+  LASSERT_TYPE("str-find", a, 0, LVAL_STR);
+  LASSERT_TYPE("str-find", a, 1, LVAL_STR);
+
+  lval *n = a->cell[0], *s = a->cell[1];
+  lval *v = lval_num(lstr_find(lstr(s), s->slen, lstr(n), n->slen));
+  lval_del(a);
+  return v;
+}
+
+lval*
+builtin_strcount(lenv* e, lval *a)
+{
+  LASSERT_NUM("str-count", a, 2);
+  LASSERT_TYPE("str-count", a, 0, LVAL_STR);
+  LASSERT_TYPE("str-count", a, 1, LVAL_STR);
+  LASSERT(a, a->cell[0]->slen, "'%s' passed an empty string to look for!", "str-count");
+
+  lval *n = a->cell[0], *s = a->cell[1];
+  char *h = lstr(s), *nd = lstr(n);
+  long count = 0;
+  size_t at = 0;
+  for (long i; (i = lstr_find(h + at, s->slen - at, nd, n->slen)) >= 0; at += i + n->slen) {
+    count++;
+  }
+  lval_del(a);
+  return lval_num(count);
+}
+
+lval*
+builtin_strsplit(lenv* e, lval *a)
+{
+  LASSERT_NUM("str-split", a, 2);
+  LASSERT_TYPE("str-split", a, 0, LVAL_STR);
+  LASSERT_TYPE("str-split", a, 1, LVAL_STR);
+  LASSERT(a, a->cell[0]->slen, "'%s' passed an empty string to look for!", "str-split");
+
+  lval *n = a->cell[0], *s = a->cell[1];
+  char *h = lstr(s), *nd = lstr(n);
+  lval *q = lval_qexpr();
+  size_t at = 0;
+  for (long i; (i = lstr_find(h + at, s->slen - at, nd, n->slen)) >= 0; at += i + n->slen) {
+    lval_add(q, lstr_slice(lval_ref(s), at, at + i));
+  }
+  lval_add(q, lstr_slice(lval_ref(s), at, s->slen));
+  lval_del(a);
+  return q;
+}
+
+lval*
+builtin_strreplace(lenv* e, lval *a)
+{
+  LASSERT_NUM("str-replace", a, 3);
+  LASSERT_TYPE("str-replace", a, 0, LVAL_STR);
+  LASSERT_TYPE("str-replace", a, 1, LVAL_STR);
+  LASSERT_TYPE("str-replace", a, 2, LVAL_STR);
+  LASSERT(a, a->cell[0]->slen, "'%s' passed an empty string to look for!", "str-replace");
+
+  lval *o = a->cell[0], *r = a->cell[1], *s = a->cell[2];
+  char *h = lstr(s), *od = lstr(o), *rd = lstr(r);
+  size_t count = 0, at = 0;
+  for (long i; (i = lstr_find(h + at, s->slen - at, od, o->slen)) >= 0; at += i + o->slen) {
+    count++;
+  }
+  if (!count) {
+    return lval_take(a, 2);
+  }
+
+  /* the result is sized up front, so every byte is copied once */
+  size_t length = s->slen - count * o->slen + count * r->slen;
+  lmap *m = lmap_new(NULL, length);
+  char *out = m->data;
+  at = 0;
+  for (long i; (i = lstr_find(h + at, s->slen - at, od, o->slen)) >= 0; at += i + o->slen) {
+    memcpy(out, h + at, i);
+    memcpy(out + i, rd, r->slen);
+    out += i + r->slen;
+  }
+  memcpy(out, h + at, s->slen - at);
+  m->used = length;
+  m->data[length] = 0;
+
+  lval *v = new_lval(LPOOL_SEQ);
+  v->type = LVAL_STR;
+  v->map = m;
+  v->sym = m->data;
+  v->slen = length;
+  lval_del(a);
+  return v;
+}
+
+lval*
+builtin_strcompare(lenv* e, lval *a)
+{
+  LASSERT_NUM("str-compare", a, 2);
+  LASSERT_TYPE("str-compare", a, 0, LVAL_STR);
+  LASSERT_TYPE("str-compare", a, 1, LVAL_STR);
+
+  lval *x = a->cell[0], *y = a->cell[1];
+  char *xd = lstr(x), *yd = lstr(y);
+  int c = memcmp(xd, yd, x->slen < y->slen ? x->slen : y->slen);
+  if (!c) {
+    c = (x->slen > y->slen) - (x->slen < y->slen);
+  }
+  lval_del(a);
+  return lval_num(c < 0 ? -1 : c > 0);
+}
+
+lval*
+builtin_list(lenv* e, lval *a)
+{
+  a->type = LVAL_QEXPR;
+  return a;
+}
+
+lval*
+builtin_len(lenv* e, lval *a)
+{
+  if (a->cell[0]->type != LVAL_MAP && a->cell[0]->type != LVAL_NUMS) {
+    LASSERT_TYPE_LIST("len", a, 0);
+  }
+  lval* v = lval_num(a->cell[0]->count);
+  lval_del(a);
+  return v;
+}
+
+lval*
+builtin_init(lenv* e, lval *a)
+{
+  LASSERT_NUM("init", a, 1);
+  LASSERT_TYPE("init", a, 0, LVAL_QEXPR);
+  LASSERT_EMPTY("init", a);
+  
+  lval* v = lval_take(a, 0);
+  return lval_slice(v, 0, v->count - 1);
+}
+
+lval*
+builtin_cons(lenv* e, lval *a)
+{
+  LASSERT_NUM("cons", a, 2);
+  LASSERT_TYPE("cons", a, 1, LVAL_QEXPR);  
+  
+  lval *v = lval_pop(a, 0);
+  lval *qlist = lval_own(lval_take(a, 0));
+  lval_add_front(qlist, v);
+  return qlist;
+}
+
+lval*
+builtin_vec(lenv* e, lval *a)
+{
+  LASSERT_NUM("vec", a, 1);
+  LASSERT_TYPE("vec", a, 0, LVAL_QEXPR);
+
+  lval *q = a->cell[0];
+  lval *v = lval_vec();
+  for (int i = 0; i < q->count; i++) {
+    lvec_set(v, i, lval_ref(q->cell[i]));
+  }
+  lval_del(a);
+  return v;
+}
+
+lval*
+builtin_vec_list(lenv* e, lval *a)
+{
+  LASSERT_NUM("vec-list", a, 1);
+  LASSERT_TYPE("vec-list", a, 0, LVAL_VEC);
+
+  lval *v = a->cell[0];
+  lval *q = lval_reserve(lval_qexpr(), v->count);
+  for (int i = 0; i < v->count; i++) {
+    lval_add(q, lval_ref(lvec_get(v, i)));
+  }
+  lval_del(a);
+  return q;
+}
+
+lval*
+builtin_nth(lenv* e, lval *a)
+{
+  LASSERT_NUM("nth", a, 2);
+  LASSERT_TYPE("nth", a, 0, LVAL_NUM);
+  if (a->cell[1]->type != LVAL_NUMS) {
+    LASSERT_TYPE_LIST("nth", a, 1);
+  }
+
+  long i = a->cell[0]->num;
+  lval *v = a->cell[1];
+  LASSERT(a, i >= 0 && i < v->count, "'nth' index %li out of range for length %i", i, v->count);
+  lval *x;
+  if (v->type == LVAL_NUMS) {
+    x = v->nums->flt ? lval_fnum(lnums_flts(v->nums)[i]) : lval_num(v->nums->ints[i]);
+  } else {
+    x = lval_ref(v->type == LVAL_VEC ? lvec_get(v, i) : v->cell[i]);
+  }
+  lval_del(a);
+  return x;
+}
+
+lval*
+builtin_assoc(lenv* e, lval *a)
+{
+  LASSERT_NUM("assoc", a, 3);
+  LASSERT_TYPE("assoc", a, 0, LVAL_NUM);
+  LASSERT_TYPE("assoc", a, 2, LVAL_VEC);
+
+  long i = a->cell[0]->num;
+  LASSERT(a, i >= 0 && i <= a->cell[2]->count, "'assoc' index %li out of range for length %i", i, a->cell[2]->count);
+  lval *x = lval_pop(a, 1);
+  lval *v = lval_own(lval_take(a, 1));
+  return lvec_set(v, i, x);
+}
+
+lval*
+builtin_push(lenv* e, lval *a)
+{
+  LASSERT_NUM("push", a, 2);
+  LASSERT_TYPE("push", a, 1, LVAL_VEC);
+
+  lval *x = lval_pop(a, 0);
+  lval *v = lval_own(lval_take(a, 0));
+  return lvec_set(v, v->count, x);
+}
+
+lval*
+builtin_slice(lenv* e, lval *a)
+{
+  LASSERT_NUM("slice", a, 3);
+  LASSERT_TYPE("slice", a, 0, LVAL_NUM);
+  LASSERT_TYPE("slice", a, 1, LVAL_NUM);
+  LASSERT_TYPE_LIST("slice", a, 2);
+
+  long from = a->cell[0]->num;
+  long to = a->cell[1]->num;
+  int count = a->cell[2]->count;
+  LASSERT(a, from >= 0 && from <= to && to <= count, "'slice' range %li to %li out of range for length %i", from, to, count);
+  lval *v = lval_take(a, 2);
+  return v->type == LVAL_VEC ? lvec_slice(v, from, to) : lval_slice(v, from, to);
+}
+
+/* a numeric array of the numbers in a Q-Expression or Vector, of doubles
+ * if any of them is one */
+lval*
+builtin_array(lenv* e, lval *a)
+{
+  LASSERT_NUM("array", a, 1);
+  LASSERT_TYPE_LIST("array", a, 0);
+
+  lval *q = a->cell[0];
+  int flt = 0;
+  for (int i = 0; i < q->count; i++) {
+    lval *x = q->type == LVAL_VEC ? lvec_get(q, i) : q->cell[i];
+    LASSERT(a, x->type == LVAL_NUM || x->type == LVAL_FNUM, "'array' item %i must be a Number that fits a machine word, got %s", i, ltype_name(x->type));
+    flt |= x->type == LVAL_FNUM;
+  }
+  lval *v = lval_nums(q->count, flt);
+  for (int i = 0; i < q->count; i++) {
+    lval *x = q->type == LVAL_VEC ? lvec_get(q, i) : q->cell[i];
+    if (flt) {
+      lnums_flts(v->nums)[i] = EXTRACT_FNUM(x);
+    } else {
+      v->nums->ints[i] = x->num;
+    }
+  }
+  lval_del(a);
+  return v;
+}
+
+lval*
+builtin_array_list(lenv* e, lval *a)
+{
+  LASSERT_NUM("array-list", a, 1);
+  LASSERT_TYPE("array-list", a, 0, LVAL_NUMS);
+
+  lval *v = a->cell[0];
+  lval *q = lval_reserve(lval_qexpr(), v->count);
+  for (int i = 0; i < v->count; i++) {
+    lval_add(q, v->nums->flt ? lval_fnum(lnums_flts(v->nums)[i]) : lval_num(v->nums->ints[i]));
+  }
+  lval_del(a);
+  return q;
+}
+
+/* the numbers from 0 below n */
+lval*
+builtin_array_range(lenv* e, lval *a)
+{
+  LASSERT_NUM("array-range", a, 1);
+  LASSERT_TYPE("array-range", a, 0, LVAL_NUM);
+
+  long n = a->cell[0]->num;
+  LASSERT(a, n >= 0 && (int)n == n, "'array-range' passed an invalid length %li", n);
+  lval *v = lval_nums(n, 0);
+  for (long i = 0; i < n; i++) {
+    v->nums->ints[i] = i;
+  }
+  lval_del(a);
+  return v;
+}
+
+/* the sum of x[i], of x[i] * y[i] when there is y, or the product of x[i],
+ * computed one number at a time so it turns to a bignum where the kernels
+ * overflowed */
+lval*
+lnums_exact(int op, long n, const long *x, const long *y)
+{
+  lval *r = lval_num(op == LARITH_MUL ? 1 : 0);
+  for (long i = 0; i < n && r->type != LVAL_ERR; i++) {
+    lval *t = lval_num(x[i]);
+    if (y) {
+      lval *u = lval_num(y[i]), *p = eval_mul(t, u);
+      lval_del(t);
+      lval_del(u);
+      t = p;
+    }
+    lval *s = larith_ops[op](r, t);
+    lval_del(r);
+    lval_del(t);
+    r = s;
+  }
+  return r;
+}
+
+lval*
+builtin_fold(lenv* e, lval *a, int op, const char *name)
+{
+  LASSERT_NUM(name, a, 1);
+  LASSERT_TYPE(name, a, 0, LVAL_NUMS);
+
+  lval *v = a->cell[0], *x;
+  union { long i; double f; } r;
+  if (lnums_fold(op, v->nums->flt, v->count, v->nums->ints, &r)) {
+    x = lnums_exact(op, v->count, v->nums->ints, NULL);
+  } else {
+    x = v->nums->flt ? lval_fnum(r.f) : lval_num(r.i);
+  }
+  lval_del(a);
+  return x;
+}
+
+lval*
+builtin_vsum(lenv* e, lval *a)
+{
+  return builtin_fold(e, a, LARITH_ADD, "vsum");
+}
+
+lval*
+builtin_vmul(lenv* e, lval *a)
+{
+  return builtin_fold(e, a, LARITH_MUL, "vmul");
+}
+
+lval*
+builtin_vdot(lenv* e, lval *a)
+{
+  LASSERT_NUM("vdot", a, 2);
+  LASSERT_TYPE("vdot", a, 0, LVAL_NUMS);
+  LASSERT_TYPE("vdot", a, 1, LVAL_NUMS);
+
+  lval *x = a->cell[0], *y = a->cell[1];
+  LASSERT(a, x->count == y->count, "'vdot' passed arrays of lengths %i and %i", x->count, y->count);
+  int flt = x->nums->flt || y->nums->flt;
+  lnums *xs = flt ? lnums_flt(x) : x->nums;
+  lnums *ys = flt ? lnums_flt(y) : y->nums;
+  union { long i; double f; } r;
+  lval *d = NULL;
+  if (lnums_dot(flt, x->count, xs->ints, ys->ints, &r)) {
+    d = lnums_exact(LARITH_ADD, x->count, xs->ints, ys->ints);
+  }
+  if (flt) {
+    lnums_del(xs);
+    lnums_del(ys);
+  }
+  lval_del(a);
+  if (d) {
+    return d;
+  }
+  return flt ? lval_fnum(r.f) : lval_num(r.i);
+}
+
+/* each element of an array combined with a number, or with the element of
+ * another array at the same index: (vmap- 1 a) takes 1 off every one */
+lval*
+builtin_vmap(lenv* e, lval *a, int op, const char *name)
+{
+  LASSERT_NUM(name, a, 2);
+  LASSERT(a, a->cell[0]->type == LVAL_NUM || a->cell[0]->type == LVAL_FNUM || a->cell[0]->type == LVAL_NUMS,
+          "'%s' passed incorrect type for argument 0. Got %s, Expected Number or Array.", name, ltype_name(a->cell[0]->type));
+  LASSERT_TYPE(name, a, 1, LVAL_NUMS);
+
+  lval *x = a->cell[0], *v = a->cell[1];
+  if (x->type == LVAL_NUMS) {
+    LASSERT(a, x->count == v->count, "'%s' passed arrays of lengths %i and %i", name, x->count, v->count);
+  }
+  int flt = v->nums->flt || x->type == LVAL_FNUM || (x->type == LVAL_NUMS && x->nums->flt);
+  lnums *vs = flt ? lnums_flt(v) : v->nums;
+  lnums *xs = NULL;
+  union { long i; double f; } k;
+  if (x->type == LVAL_NUMS) {
+    xs = flt ? lnums_flt(x) : x->nums;
+  } else if (flt) {
+    k.f = EXTRACT_FNUM(x);
+  } else {
+    k.i = x->num;
+  }
+
+  lval *r = lval_nums(v->count, flt);
+  if (lnums_zip(op, flt, v->count, r->nums->ints, vs->ints, xs ? xs->ints : &k.i, !xs)) {
+    /* an array only holds machine words, like the ones (array) takes */
+    lval_del(r);
+    r = lval_err("'%s' result does not fit a machine word", name);
+  }
+  if (flt) {
+    lnums_del(vs);
+    if (xs) {
+      lnums_del(xs);
+    }
+  }
+  lval_del(a);
+  return r;
+}
+
+lval*
+builtin_vmap_add(lenv* e, lval *a)
+{
+  return builtin_vmap(e, a, LARITH_ADD, "vmap+");
+}
+
+lval*
+builtin_vmap_sub(lenv* e, lval *a)
+{
+  return builtin_vmap(e, a, LARITH_SUB, "vmap-");
+}
+
+lval*
+builtin_vmap_mul(lenv* e, lval *a)
+{
+  return builtin_vmap(e, a, LARITH_MUL, "vmap*");
+}
+
+lval*
+builtin_hash_map(lenv* e, lval *a)
+{
+  LASSERT_NUM("hash-map", a, 1);
+  LASSERT_TYPE("hash-map", a, 0, LVAL_QEXPR);
+
+  lval *q = a->cell[0];
+  LASSERT(a, q->count % 2 == 0, "'hash-map' needs a value for every key, got %i items", q->count);
+  for (int i = 0; i < q->count; i += 2) {
+    LASSERT(a, lval_hashable(q->cell[i]), "'hash-map' key %i must be a string, Symbol or Number, got %s", i / 2, ltype_name(q->cell[i]->type));
+  }
+  lval *m = lval_hmap();
+  for (int i = 0; i < q->count; i += 2) {
+    lhmap_put(m, lval_ref(q->cell[i]), lval_ref(q->cell[i + 1]));
+  }
+  lval_del(a);
+  return m;
+}
+
+lval*
+builtin_map_get(lenv* e, lval *a)
+{
+  LASSERT_NUM("map-get", a, 2);
+  LASSERT_KEY("map-get", a, 0);
+  LASSERT_TYPE("map-get", a, 1, LVAL_MAP);
+
+  lval *x = lhmap_get(a->cell[1], a->cell[0]);
+  LASSERT(a, x, "'map-get' key not found");
+  x = lval_ref(x);
+  lval_del(a);
+  return x;
+}
+
+lval*
+builtin_map_has(lenv* e, lval *a)
+{
+  LASSERT_NUM("map-has", a, 2);
+  LASSERT_KEY("map-has", a, 0);
+  LASSERT_TYPE("map-has", a, 1, LVAL_MAP);
+
+  lval *x = lval_bool(lhmap_get(a->cell[1], a->cell[0]) != NULL);
+  lval_del(a);
+  return x;
+}
+
+lval*
+builtin_map_put(lenv* e, lval *a)
+{
+  LASSERT_NUM("map-put", a, 3);
+  LASSERT_KEY("map-put", a, 0);
+  LASSERT_TYPE("map-put", a, 2, LVAL_MAP);
+
+  lval *k = lval_pop(a, 0);
+  lval *x = lval_pop(a, 0);
+  lval *m = lval_own(lval_take(a, 0));
+  return lhmap_put(m, k, x);
+}
+
+lval*
+builtin_map_del(lenv* e, lval *a)
+{
+  LASSERT_NUM("map-del", a, 2);
+  LASSERT_KEY("map-del", a, 0);
+  LASSERT_TYPE("map-del", a, 1, LVAL_MAP);
+
+  lval *k = lval_pop(a, 0);
+  lval *m = lval_own(lval_take(a, 0));
+  m = lhmap_del(m, k);
+  lval_del(k);
+  return m;
+}
+
+lval*
+builtin_map_keys(lenv* e, lval *a)
+{
+  LASSERT_NUM("map-keys", a, 1);
+  LASSERT_TYPE("map-keys", a, 0, LVAL_MAP);
+
+  lval *m = a->cell[0];
+  lval *q = lval_reserve(lval_qexpr(), m->count);
+  lhnode_list(m->hroot, q, 0);
+  lval_del(a);
+  return q;
+}
+
+lval*
+builtin_eval(lenv* e, lval *a)
+{
+  LASSERT_NUM("eval", a, 1);
+  LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
+    
+  return lval_eval_sexpr(e, lval_take(a, 0));
+}
+
+/* comparison operators, their names are only needed for errors */
+enum { LCMP_GT, LCMP_GE, LCMP_LT, LCMP_LE, LCMP_EQ, LCMP_NE };
+
+static const char *lcmp_names[] = {
+  [LCMP_GT] = ">", [LCMP_GE] = ">=", [LCMP_LT] = "<", [LCMP_LE] = "<=",
+  [LCMP_EQ] = "==", [LCMP_NE] = "!=",
+};
+
+lval*
+builtin_ord(lenv *e, lval *a, int op)
+{
+  LASSERT_NUM(lcmp_names[op], a, 2);
+  LASSERT_TYPE_NUMBER(lcmp_names[op], a, 0);
+  LASSERT_TYPE_NUMBER(lcmp_names[op], a, 1);
+
+  lval *x = a->cell[0], *y = a->cell[1];
+  int i = 0;
+  if (x->type == LVAL_FNUM || y->type == LVAL_FNUM) {
+    double fx = EXTRACT_FNUM(x), fy = EXTRACT_FNUM(y);
+    switch (op) {
+    case LCMP_GT: i = fx > fy; break;
+    case LCMP_GE: i = fx >= fy; break;
+    case LCMP_LT: i = fx < fy; break;
+    case LCMP_LE: i = fx <= fy; break;
+    }
+  } else {
+    int c = lnum_cmp(x, y);
+    switch (op) {
+    case LCMP_GT: i = c > 0; break;
+    case LCMP_GE: i = c >= 0; break;
+    case LCMP_LT: i = c < 0; break;
+    case LCMP_LE: i = c <= 0; break;
+    }
+  }
+  
+  lval_del(a);
+  return lval_bool(i);
+}
+
+static inline lval*
+builtin_gt(lenv *e, lval *a)
+{
+  return builtin_ord(e, a, LCMP_GT);
+}
+
+static inline lval*
+builtin_gte(lenv *e, lval *a)
+{
+  return builtin_ord(e, a, LCMP_GE);
+}
+
+static inline lval*
+builtin_lt(lenv *e, lval *a)
+{
+  return builtin_ord(e, a, LCMP_LT);
+}
+
+static inline lval*
+builtin_lte(lenv *e, lval *a)
+{
+  return builtin_ord(e, a, LCMP_LE);
+}
+
+int
+lval_eq(lval *x, lval *y)
+{
+  if (x->type != y->type)
+    return 0;
+
+  switch (x->type) {
+  case LVAL_STR:
+    lstr(x);
+    lstr(y);
+    return x->slen == y->slen && memcmp(x->sym, y->sym, x->slen) == 0;
+  case LVAL_NUM:
+    return x->num == y->num;
+  case LVAL_FNUM:
+    return x->fnum == y->fnum;
+  case LVAL_BIG:
+    return lnum_cmp(x, y) == 0;
+  case LVAL_ERR:
+    return strcmp(x->err, y->err) == 0;
+  case LVAL_SYM:
+    return x->sym == y->sym;
+  case LVAL_FUNC:
+    if (x->func) {
+      return x->func == y->func;
+    } else {
+      return lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body);
+    }
+  case LVAL_QEXPR:
+  case LVAL_SEXPR:
+    if (x->count != y->count) return 0;
+    for (int i = 0; i < x->count; i++) {
+      if (!lval_eq(x->cell[i], y->cell[i])) {
+        return 0;
+      }
+    }
+    return 1;
+  case LVAL_VEC:
+    if (x->count != y->count) return 0;
+    for (int i = 0; i < x->count; i++) {
+      if (!lval_eq(lvec_get(x, i), lvec_get(y, i))) {
+        return 0;
+      }
+    }
+    return 1;
+  case LVAL_MAP: {
+    if (x->count != y->count) return 0;
+    lval *q = lval_qexpr();
+    lhnode_list(x->hroot, q, 1);
+    int eq = 1;
+    for (int i = 0; eq && i < q->count; i += 2) {
+      lval *v = lhmap_get(y, q->cell[i]);
+      eq = v && lval_eq(v, q->cell[i + 1]);
+    }
+    lval_del(q);
+    return eq;
+  }
+  case LVAL_NUMS:
+    if (x->count != y->count || x->nums->flt != y->nums->flt) return 0;
+    for (int i = 0; i < x->count; i++) {
+      if (x->nums->flt ? lnums_flts(x->nums)[i] != lnums_flts(y->nums)[i] : x->nums->ints[i] != y->nums->ints[i]) {
+        return 0;
+      }
+    }
+    return 1;
+  default:
+    break;
+  }
+  return 0;
+}
+
+lval*
+builtin_equality(lenv *e, lval *a, int op)
+{
+  LASSERT_NUM(lcmp_names[op], a, 2);
+  int r = lval_eq(a->cell[0], a->cell[1]) == (op == LCMP_EQ);
+  lval_del(a);
+  return lval_bool(r);
 }
 
 static inline lval*
-builtin_gte(lenv *e, lval *a)
+builtin_eq(lenv *e, lval *a)
 {
-  return builtin_ord(e, a, ">=");  
+  return builtin_equality(e, a, LCMP_EQ);
 }
 
 static inline lval*
-builtin_lt(lenv *e, lval *a)
+builtin_neq(lenv *e, lval *a)
+{
+  return builtin_equality(e, a, LCMP_NE);
+}
+
+lval*
+builtin_not(lenv *e, lval *a)
+{
+  LASSERT_NUM("!", a, 1);
+  lval *r = lval_tobool(a);
+  lval_del(a);
+  if (r->type == LVAL_BOOL) {
+    int x = !r->num;
+    lval_del(r);
+    r = lval_bool(x);
+  }
+  return r;
+}
+
+lval*
+builtin_and(lenv *e, lval *a)
+{
+  int r = 1;
+  lval* rl = NULL;
+  for (int i = 0; i < a->count; i++) {
+    lval* b = lval_tobool(a->cell[i]);
+    if (b->type == LVAL_ERR) {
+      rl = b;
+      break;
+    }
+    r = r && b->num;
+    if (!r) {
+      rl = b;
+      break;
+    }
+    lval_del(b);
+  }
+  lval_del(a);
+  return rl;
+}
+
+lval*
+builtin_or(lenv *e, lval *a)
+{
+  int r = 0;
+  lval* rl = NULL;
+  for (int i = 0; i < a->count; i++) {
+    lval* b = lval_tobool(a->cell[i]);
+    if (b->type == LVAL_ERR) {
+      rl = b;
+      break;
+    }
+    r = r || b->num;
+    if (r) {
+      rl = b;
+      break;
+    }
+    lval_del(b);
+  }
+  lval_del(a);
+  return rl;
+}
+
+lval*
+builtin_show(lenv *e, lval *a)
+{
+  LASSERT_NUM("show", a, 1);
+  LASSERT_TYPE("show", a, 0, LVAL_STR);
+  fwrite(lstr(a->cell[0]), 1, a->cell[0]->slen, stdout);
+  lval_del(a);
+  return lval_sexpr();
+}
+
+lval*
+builtin_print(lenv *e, lval *a)
+{
+  for (int i = 0; i < a->count; i++) {
+    lval_print(a->cell[0]);
+    putchar(' ');
+  }
+  putchar('\n');
+  lval_del(a);
+  return lval_sexpr();
+}
+
+lval*
+builtin_error(lenv *e, lval *a)
+{
+  LASSERT_NUM("error", a, 1);
+  LASSERT_TYPE("error", a, 0, LVAL_STR);
+  lval* err = lval_err(lstr_cstr(a->cell[0]));
+  lval_del(a);
+  return err;
+}
+
+lval*
+builtin_read(lenv *e, lval *a)
+{
+  LASSERT_NUM("read", a, 1);
+  LASSERT_TYPE("read", a, 0, LVAL_STR);
+
+  if (!lmpc_enabled) {
+    char *src = lstr_cstr(a->cell[0]);
+    lval *ret = lread_all("<read>", src, strlen(src));
+    if (ret->type != LVAL_ERR) {
+      ret->type = LVAL_QEXPR;
+    }
+    lval_del(a);
+    return ret;
+  }
+
+  mpc_result_t r;
+  lval* ret;
+  if (mpc_parse("<read>", lstr_cstr(a->cell[0]), ParserLispy, &r)) {
+    ret = lval_read(r.output);
+    ret->type = LVAL_QEXPR;
+    mpc_ast_delete(r.output);
+  } else {
+    char *error_msg = mpc_err_string(r.error);
+    mpc_err_delete(r.error);
+    ret = lval_err(error_msg);
+    free(error_msg);
+  }
+  lval_del(a);
+  return ret;
+}
+
+lval*
+lval_load_mpc(lenv *e, lval *a)
+{
+  mpc_result_t r;
+  if (!mpc_parse_contents(lstr_cstr(a->cell[0]), ParserLispy, &r)) {
+    char *error_msg = mpc_err_string(r.error);
+    mpc_err_delete(r.error);
+    lval* err = lval_err(error_msg);
+    free(error_msg);
+    lval_del(a);
+    return err;
+  }
+  lval *expr = lval_read(r.output);
+  mpc_ast_delete(r.output);
+
+  gc_push_root(a);
+  gc_push_root(expr);
+  while (expr->count) {
+    lval *x = lval_eval(e, lval_pop(expr, 0));
+    if (x->type == LVAL_ERR) {
+      lval_println(x);
+    }
+    lval_del(x);
+    larena_reset(&scratch);
+    gc_safe_point();
+  }
+  gc_pop_root();
+  gc_pop_root();
+  lval_del(expr);
+  lval_del(a);
+  return lval_sexpr();
+}
+
+/* Reads the file named by a. With eval set each form is evaluated as soon
+ * as it is read and dropped before the next one, memory stays bounded by
+ * the largest form, otherwise the forms are returned as a Q-Expression.
+ * Regular files are mapped, their strings point into the mapping. A
+ * syntax error stops the load, the forms before it have already run. */
+lval*
+lval_load(lenv *e, lval *a, int eval)
+{
+  char *name = lstr_cstr(a->cell[0]);
+  lreader r;
+  FILE *f = NULL;
+  lmap *map = lmap_open(name);
+  if (map) {
+    lread_init(&r, name, map->data, map->len, NULL);
+    r.map = map;
+  } else {
+    f = fopen(name, "rb");
+    if (!f) {
+      lval *err = lval_err("%s: error: Unable to open file!", name);
+      lval_del(a);
+      return err;
+    }
+    lread_init(&r, name, NULL, 0, f);
+  }
+
+  gc_push_root(a);
+  lval *data = eval ? NULL : lval_qexpr();
+  lval *x;
+  lval *err = NULL;
+  while ((x = lread_next(&r))) {
+    if (x->type == LVAL_ERR) {
+      err = x;
+      break;
+    }
+    if (!eval) {
+      lval_add(data, x);
+      continue;
+    }
+    x = lval_eval(e, x);
+    if (x->type == LVAL_ERR) {
+      lval_println(x);
+    }
+    lval_del(x);
+    larena_reset(&scratch);
+    gc_safe_point();
+  }
+  gc_pop_root();
+  lread_close(&r);
+  if (f) {
+    fclose(f);
+  }
+  if (map) {
+    lmap_del(map);
+  }
+  lval_del(a);
+  if (err) {
+    if (data) {
+      lval_del(data);
+    }
+    return err;
+  }
+  return eval ? lval_sexpr() : data;
+}
+
+lval*
+builtin_load(lenv *e, lval *a)
+{
+  LASSERT_NUM("load", a, 1);
+  LASSERT_TYPE("load", a, 0, LVAL_STR);
+
+  if (lmpc_enabled) {
+    return lval_load_mpc(e, a);
+  }
+  return lval_load(e, a, 1);
+}
+
+lval*
+builtin_load_data(lenv *e, lval *a)
+{
+  LASSERT_NUM("load-data", a, 1);
+  LASSERT_TYPE("load-data", a, 0, LVAL_STR);
+  return lval_load(e, a, 0);
+}
+
+/* Binary encoding of values. Every value starts with a tag byte, the
+ * LVAL_* type or one of the LTAG_* below, followed by its payload with
+ * integers as LEB128 varints. Objects referenced more than once are
+ * flagged with LTAG_SHARED when first written and later written as an
+ * LTAG_REF to their id, so sharing survives a round trip. Symbol names
+ * are written once and referred to by number afterwards. Strings keep a
+ * trailing NUL so a decoder can point into the encoded bytes. */
+enum { LTAG_REF = 32, LTAG_ENV, LTAG_NOENV, LTAG_BUILTIN };
+#define LTAG_SHARED 0x80
+
+#define LIMAGE_MAGIC "LSPYIMG1"
+
+/* pointer to id map, ids are handed out in insertion order */
+typedef struct {
+  void **keys;
+  int *ids;
+  int cap;
+  int count;
+} lptrmap;
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+  lptrmap shared;
+  lptrmap syms;
+} lenc;
+
+typedef struct {
+  void *p;
+  int is_env;
+  /* fully decoded, references to it may be taken */
+  int done;
+} ldec_obj;
+
+typedef struct {
+  const char *p;
+  const char *end;
+  lmap *map;
+  ldec_obj *objs;
+  int nobjs;
+  int cap;
+  char **syms;
+  int nsyms;
+  int csyms;
+} ldec;
+
+void
+lenc_bytes(lenc *w, const void *p, size_t n)
+{
+  if (w->len + n > w->cap) {
+    while (w->len + n > w->cap) {
+      w->cap = w->cap ? w->cap * 2 : 4096;
+    }
+    w->data = realloc(w->data, w->cap);
+  }
+  memcpy(w->data + w->len, p, n);
+  w->len += n;
+}
+
+static inline void
+lenc_byte(lenc *w, unsigned char c)
+{
+  lenc_bytes(w, &c, 1);
+}
+
+void
+lenc_uint(lenc *w, unsigned long x)
+{
+  unsigned char buf[10];
+  int n = 0;
+  do {
+    buf[n] = x & 0x7f;
+    x >>= 7;
+    if (x) {
+      buf[n] |= 0x80;
+    }
+    n++;
+  } while (x);
+  lenc_bytes(w, buf, n);
+}
+
+static inline void
+lenc_int(lenc *w, long x)
+{
+  lenc_uint(w, ((unsigned long)x << 1) ^ (unsigned long)(x >> 63));
+}
+
+void
+lenc_strn(lenc *w, const char *s, size_t n)
+{
+  lenc_uint(w, n);
+  lenc_bytes(w, s, n);
+  lenc_byte(w, 0);
+}
+
+static inline void
+lenc_str(lenc *w, const char *s)
+{
+  lenc_strn(w, s, strlen(s));
+}
+
+/* id of p, -1 if it is not in the map */
+int
+lptrmap_get(lptrmap *m, void *p)
+{
+  if (!m->cap) {
+    return -1;
+  }
+  unsigned long i = ((unsigned long)p >> 4) & (m->cap - 1);
+  while (m->keys[i]) {
+    if (m->keys[i] == p) {
+      return m->ids[i];
+    }
+    i = (i + 1) & (m->cap - 1);
+  }
+  return -1;
+}
+
+static void
+lptrmap_insert(lptrmap *m, void *p, int id)
+{
+  unsigned long i = ((unsigned long)p >> 4) & (m->cap - 1);
+  while (m->keys[i]) {
+    i = (i + 1) & (m->cap - 1);
+  }
+  m->keys[i] = p;
+  m->ids[i] = id;
+}
+
+/* gives p the next id */
+void
+lptrmap_put(lptrmap *m, void *p)
+{
+  if (m->count * 2 >= m->cap) {
+    int cap = m->cap;
+    void **keys = m->keys;
+    int *ids = m->ids;
+    m->cap = cap ? cap * 2 : 64;
+    m->keys = calloc(m->cap, sizeof(void*));
+    m->ids = malloc(sizeof(int) * m->cap);
+    for (int i = 0; i < cap; i++) {
+      if (keys[i]) {
+        lptrmap_insert(m, keys[i], ids[i]);
+      }
+    }
+    free(keys);
+    free(ids);
+  }
+  lptrmap_insert(m, p, m->count++);
+}
+
+void
+lptrmap_free(lptrmap *m)
+{
+  free(m->keys);
+  free(m->ids);
+}
+
+void
+lenc_free(lenc *w)
+{
+  free(w->data);
+  lptrmap_free(&w->shared);
+  lptrmap_free(&w->syms);
+}
+
+/* an interned symbol name, 0 followed by the name the first time, its
+ * number plus one afterwards */
+void
+lenc_sym(lenc *w, char *sym)
+{
+  int id = lptrmap_get(&w->syms, sym);
+  if (id >= 0) {
+    lenc_uint(w, id + 1);
+    return;
+  }
+  lptrmap_put(&w->syms, sym);
+  lenc_uint(w, 0);
+  lenc_str(w, sym);
+}
+
+/* writes the tag of an object, 0 if it was a reference to one already
+ * written. Only shared objects can have been written before */
+int
+lenc_tag(lenc *w, void *p, int shared, int tag)
 {
-  return builtin_ord(e, a, "<");    
+  if (shared) {
+    int id = lptrmap_get(&w->shared, p);
+    if (id >= 0) {
+      lenc_byte(w, LTAG_REF);
+      lenc_uint(w, id);
+      return 0;
+    }
+    lptrmap_put(&w->shared, p);
+    tag |= LTAG_SHARED;
+  }
+  lenc_byte(w, tag);
+  return 1;
 }
 
-static inline lval*
-builtin_lte(lenv *e, lval *a)
+void lenc_lval(lenc *w, lval *v);
+
+void
+lenc_env(lenc *w, lenv *e)
 {
-  return builtin_ord(e, a, "<=");
+  if (!e) {
+    lenc_byte(w, LTAG_NOENV);
+    return;
+  }
+  if (!lenc_tag(w, e, e->ref > 1, LTAG_ENV)) {
+    return;
+  }
+  lenc_uint(w, e->count);
+  for (int i = 0; i < e->count; i++) {
+    lenc_sym(w, e->syms[i]);
+    lenc_lval(w, e->vals[i]);
+  }
+  lenc_env(w, e->parent);
 }
 
-int
-lval_eq(lval *x, lval *y)
+void
+lenc_lval(lenc *w, lval *v)
 {
-  if (x->type != y->type)
-    return 0;
+  if (v->type == LVAL_FUNC && v->func) {
+    lenc_byte(w, LTAG_BUILTIN);
+    lenc_str(w, lbuiltin_name(v->func));
+    return;
+  }
+  /* the preallocated small ints and bools are not worth keeping shared */
+  if (!lenc_tag(w, v, v->ref > 1 && !(v->gc & LGC_STATIC), v->type)) {
+    return;
+  }
 
-  switch (x->type) {
-  case LVAL_STR:
-    return strcmp(x->sym, y->sym) == 0;
+  switch (v->type) {
   case LVAL_NUM:
+  case LVAL_BOOL:
+    lenc_int(w, v->num);
+    break;
   case LVAL_FNUM:
-    return EXTRACT_VALUE(x) == EXTRACT_VALUE(y);
+    lenc_bytes(w, &v->fnum, sizeof(double));
+    break;
+  case LVAL_BIG:
+    lenc_byte(w, v->big->neg);
+    lenc_uint(w, v->big->len);
+    lenc_bytes(w, v->big->d, sizeof(unsigned) * v->big->len);
+    break;
+  case LVAL_STR:
+    lenc_strn(w, lstr(v), v->slen);
+    break;
   case LVAL_ERR:
-    return strcmp(x->err, y->err);
+    lenc_str(w, v->err);
+    break;
   case LVAL_SYM:
-    return strcmp(x->sym, y->sym);
+    lenc_sym(w, v->sym);
+    lenc_uint(w, v->depth);
+    lenc_uint(w, v->slot);
+    break;
   case LVAL_FUNC:
-    if (x->func) {
-      return x->func == y->func;
-    } else {
-      return lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body);
-    }
-  case LVAL_QEXPR:
+    lenc_lval(w, v->formals);
+    lenc_lval(w, v->body);
+    lenc_env(w, v->env);
+    break;
   case LVAL_SEXPR:
-    if (x->count != y->count) return 0;
-    for (int i = 0; i < x->count; i++) {
-      if (!lval_eq(x->cell[i], y->cell[i])) {
-        return 0;
+  case LVAL_QEXPR:
+    lenc_uint(w, v->count);
+    for (int i = 0; i < v->count; i++) {
+      lenc_lval(w, v->cell[i]);
+    }
+    break;
+  case LVAL_VEC:
+    lenc_uint(w, v->count);
+    for (int i = 0; i < v->count; i++) {
+      lenc_lval(w, lvec_get(v, i));
+    }
+    break;
+  case LVAL_MAP: {
+    lval *q = lval_qexpr();
+    lhnode_list(v->hroot, q, 1);
+    lenc_uint(w, v->count);
+    for (int i = 0; i < q->count; i++) {
+      lenc_lval(w, q->cell[i]);
+    }
+    lval_del(q);
+    break;
+  }
+  case LVAL_NUMS:
+    lenc_uint(w, v->count);
+    lenc_byte(w, v->nums->flt);
+    if (v->nums->flt) {
+      lenc_bytes(w, v->nums->ints, sizeof(double) * v->count);
+    } else {
+      for (int i = 0; i < v->count; i++) {
+        lenc_int(w, v->nums->ints[i]);
       }
     }
-    return 1;
-  default:
     break;
   }
+}
+
+int
+ldec_byte(ldec *r)
+{
+  return r->p < r->end ? (unsigned char)*r->p++ : -1;
+}
+
+int
+ldec_uint(ldec *r, unsigned long *x)
+{
+  *x = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int c = ldec_byte(r);
+    if (c < 0) {
+      return 0;
+    }
+    *x |= (unsigned long)(c & 0x7f) << shift;
+    if (!(c & 0x80)) {
+      return 1;
+    }
+  }
   return 0;
 }
 
-lval*
-builtin_equality(lenv *e, lval *a, const char *op)
+/* a NUL terminated string of the input, NULL when truncated */
+const char*
+ldec_str(ldec *r, unsigned long *n)
 {
-  LASSERT_NUM(op, a, 2);
-  int r = 0;
-  if (strcmp(op, "==") == 0) {
-    r = lval_eq(a->cell[0], a->cell[1]);
-  } else if (strcmp(op, "!=") == 0) {
-    r = !lval_eq(a->cell[0], a->cell[1]);    
+  if (!ldec_uint(r, n) || *n >= (unsigned long)(r->end - r->p) || r->p[*n]) {
+    return NULL;
   }
-  lval_del(a);
-  return lval_bool(r);
+  const char *s = r->p;
+  r->p += *n + 1;
+  return s;
 }
 
-static inline lval*
-builtin_eq(lenv *e, lval *a)
+void
+ldec_share(ldec *r, void *p, int is_env)
 {
-  return builtin_equality(e, a, "==");
+  if (r->nobjs == r->cap) {
+    r->cap = r->cap ? r->cap * 2 : 64;
+    r->objs = realloc(r->objs, sizeof(ldec_obj) * r->cap);
+  }
+  r->objs[r->nobjs].p = p;
+  r->objs[r->nobjs].is_env = is_env;
+  r->objs[r->nobjs].done = 0;
+  r->nobjs++;
 }
 
-static inline lval*
-builtin_neq(lenv *e, lval *a)
+/* the object a reference points to, NULL when the id is bad, names the
+ * wrong kind of object or one still being decoded, which would make it
+ * contain itself */
+void*
+ldec_ref(ldec *r, int is_env)
 {
-  return builtin_equality(e, a, "!=");
+  unsigned long id;
+  if (!ldec_uint(r, &id) || id >= (unsigned long)r->nobjs || r->objs[id].is_env != is_env || !r->objs[id].done) {
+    return NULL;
+  }
+  return r->objs[id].p;
 }
 
-lval*
-builtin_not(lenv *e, lval *a)
+/* an interned symbol written by lenc_sym, NULL when malformed */
+char*
+ldec_sym(ldec *r)
 {
-  LASSERT_NUM("!", a, 1);
-  lval *r = lval_tobool(a);
-  lval_del(a);
-  if (r->type == LVAL_BOOL) {
-    r->num = !r->num;
+  unsigned long id;
+  if (!ldec_uint(r, &id)) {
+    return NULL;
   }
-  return r;
+  if (id) {
+    return id <= (unsigned long)r->nsyms ? r->syms[id - 1] : NULL;
+  }
+  unsigned long n;
+  const char *s = ldec_str(r, &n);
+  if (!s) {
+    return NULL;
+  }
+  if (r->nsyms == r->csyms) {
+    r->csyms = r->csyms ? r->csyms * 2 : 64;
+    r->syms = realloc(r->syms, sizeof(char*) * r->csyms);
+  }
+  return r->syms[r->nsyms++] = lsym_intern_len(s, n);
 }
 
-lval*
-builtin_and(lenv *e, lval *a)
+lval *ldec_lval(ldec *r);
+
+/* decodes an env into *out, returns 0 on malformed input */
+int
+ldec_env(ldec *r, lenv **out)
 {
-  int r = 1;
-  lval* rl = NULL;
-  for (int i = 0; i < a->count; i++) {
-    lval* b = lval_tobool(a->cell[i]);
-    if (b->type == LVAL_ERR) {
-      rl = b;
-      break;
+  int tag = ldec_byte(r);
+  *out = NULL;
+  if (tag == LTAG_NOENV) {
+    return 1;
+  }
+  if (tag == LTAG_REF) {
+    lenv *e = ldec_ref(r, 1);
+    if (!e) {
+      return 0;
     }
-    r = r && b->num;
-    if (!r) {
-      rl = b;
-      break;
+    *out = lenv_ref(e);
+    return 1;
+  }
+  if ((tag & ~LTAG_SHARED) != LTAG_ENV) {
+    return 0;
+  }
+
+  lenv *e = lenv_new();
+  *out = e;
+  int id = r->nobjs;
+  if (tag & LTAG_SHARED) {
+    ldec_share(r, e, 1);
+  }
+  unsigned long count;
+  if (!ldec_uint(r, &count)) {
+    return 0;
+  }
+  for (unsigned long i = 0; i < count; i++) {
+    char *sym = ldec_sym(r);
+    lval *v = sym ? ldec_lval(r) : NULL;
+    if (!v) {
+      return 0;
     }
-    lval_del(b);
+    lenv_put_sym(e, sym, v);
+    lval_del(v);
   }
-  lval_del(a);
-  return rl;
+  if (!ldec_env(r, &e->parent)) {
+    return 0;
+  }
+  if (tag & LTAG_SHARED) {
+    r->objs[id].done = 1;
+  }
+  return 1;
 }
 
 lval*
-builtin_or(lenv *e, lval *a)
+ldec_value(ldec *r)
 {
-  int r = 0;
-  lval* rl = NULL;
-  for (int i = 0; i < a->count; i++) {
-    lval* b = lval_tobool(a->cell[i]);
-    if (b->type == LVAL_ERR) {
-      rl = b;
+  int tag = ldec_byte(r);
+  if (tag < 0) {
+    return NULL;
+  }
+  if (tag == LTAG_REF) {
+    lval *v = ldec_ref(r, 0);
+    return v ? lval_ref(v) : NULL;
+  }
+
+  unsigned long n;
+  const char *s;
+  if (tag == LTAG_BUILTIN) {
+    lbuiltin func;
+    if (!(s = ldec_str(r, &n)) || !(func = lbuiltin_find(s))) {
+      return NULL;
+    }
+    return lval_func(func);
+  }
+
+  int type = tag & ~LTAG_SHARED;
+  int pool;
+  switch (type) {
+  case LVAL_NUM:
+  case LVAL_BOOL:
+  case LVAL_FNUM:
+  case LVAL_ERR:
+  case LVAL_BIG:
+    pool = LPOOL_SCALAR;
+    break;
+  case LVAL_SYM:
+    pool = LPOOL_SYM;
+    break;
+  case LVAL_STR:
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+  case LVAL_VEC:
+  case LVAL_MAP:
+  case LVAL_NUMS:
+    pool = LPOOL_SEQ;
+    break;
+  case LVAL_FUNC:
+    pool = LPOOL_LAMBDA;
+    break;
+  default:
+    return NULL;
+  }
+
+  lval *v = new_lval(pool);
+  v->type = type;
+  if (tag & LTAG_SHARED) {
+    ldec_share(r, v, 0);
+  }
+
+  switch (v->type) {
+  case LVAL_NUM:
+  case LVAL_BOOL:
+    if (!ldec_uint(r, &n)) {
       break;
     }
-    r = r || b->num;
-    if (r) {
-      rl = b;
+    v->num = (long)(n >> 1) ^ -(long)(n & 1);
+    return v;
+  case LVAL_FNUM:
+    if (r->end - r->p < (long)sizeof(double)) {
       break;
     }
-    lval_del(b);
+    memcpy(&v->fnum, r->p, sizeof(double));
+    r->p += sizeof(double);
+    return v;
+  case LVAL_BIG: {
+    /* has to be what lval_big makes: normalized and past a long */
+    int neg = ldec_byte(r);
+    long x;
+    if (neg < 0 || !ldec_uint(r, &n) || n > LBIG_MAX_LIMBS || r->end - r->p < (long)(sizeof(unsigned) * n)) {
+      break;
+    }
+    lbig *b = lbig_new(n);
+    memcpy(b->d, r->p, sizeof(unsigned) * n);
+    r->p += sizeof(unsigned) * n;
+    b->neg = neg != 0;
+    if (!n || !b->d[n - 1] || lmag_long(b->d, n, b->neg, &x)) {
+      lbig_del(b);
+      break;
+    }
+    v->big = b;
+    return v;
   }
-  lval_del(a);
-  return rl;
+  case LVAL_STR:
+    if (!(s = ldec_str(r, &n))) {
+      break;
+    }
+    /* strings of a mapped image stay in the mapping */
+    if (r->map) {
+      v->sym = (char*)s;
+      v->map = lmap_ref(r->map);
+    } else {
+      v->sym = lstrndup(s, n);
+    }
+    v->slen = n;
+    return v;
+  case LVAL_ERR:
+    if (!(s = ldec_str(r, &n))) {
+      break;
+    }
+    v->err = lstrdup(s);
+    return v;
+  case LVAL_SYM: {
+    unsigned long depth, slot;
+    char *sym = ldec_sym(r);
+    if (!sym || !ldec_uint(r, &depth) || !ldec_uint(r, &slot) || depth > INT_MAX || slot > INT_MAX) {
+      break;
+    }
+    v->sym = sym;
+    v->depth = depth;
+    v->slot = slot;
+    return v;
+  }
+  case LVAL_FUNC: {
+    lval *formals = ldec_lval(r);
+    lval *body = formals ? ldec_lval(r) : NULL;
+    lenv *env = NULL;
+    /* calls take formals to be symbols, as builtin_lambda checks */
+    int ok = body && formals->type == LVAL_QEXPR && body->type == LVAL_QEXPR;
+    for (int i = 0; ok && i < formals->count; i++) {
+      ok = formals->cell[i]->type == LVAL_SYM;
+    }
+    if (!ok || !ldec_env(r, &env)) {
+      if (formals) {
+        lval_del(formals);
+      }
+      if (body) {
+        lval_del(body);
+      }
+      if (env) {
+        lenv_del(env);
+      }
+      break;
+    }
+    v->formals = formals;
+    v->body = body;
+    v->env = env;
+    return v;
+  }
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    if (!ldec_uint(r, &n)) {
+      break;
+    }
+    for (unsigned long i = 0; i < n; i++) {
+      lval *x = ldec_lval(r);
+      if (!x) {
+        lval_del(v);
+        return NULL;
+      }
+      lval_add(v, x);
+    }
+    return v;
+  case LVAL_VEC:
+    if (!ldec_uint(r, &n)) {
+      break;
+    }
+    for (unsigned long i = 0; i < n; i++) {
+      lval *x = ldec_lval(r);
+      if (!x) {
+        lval_del(v);
+        return NULL;
+      }
+      lvec_set(v, i, x);
+    }
+    return v;
+  case LVAL_MAP:
+    if (!ldec_uint(r, &n)) {
+      break;
+    }
+    for (unsigned long i = 0; i < n; i++) {
+      lval *k = ldec_lval(r);
+      lval *x = k ? ldec_lval(r) : NULL;
+      if (!x || !lval_hashable(k)) {
+        if (k) {
+          lval_del(k);
+        }
+        if (x) {
+          lval_del(x);
+        }
+        lval_del(v);
+        return NULL;
+      }
+      lhmap_put(v, k, x);
+    }
+    return v;
+  case LVAL_NUMS: {
+    /* every element takes at least a byte, which bounds n */
+    if (!ldec_uint(r, &n) || (int)n != n || r->end - r->p <= (long)n) {
+      break;
+    }
+    int flt = ldec_byte(r);
+    if (flt < 0 || flt > 1 || (flt && r->end - r->p < (long)(sizeof(double) * n))) {
+      break;
+    }
+    lnums *a = lnums_new(n, flt);
+    unsigned long i = 0, x;
+    if (flt) {
+      memcpy(a->ints, r->p, sizeof(double) * n);
+      r->p += sizeof(double) * n;
+      i = n;
+    }
+    for (; i < n && ldec_uint(r, &x); i++) {
+      a->ints[i] = (long)(x >> 1) ^ -(long)(x & 1);
+    }
+    if (i < n) {
+      lnums_del(a);
+      break;
+    }
+    v->nums = a;
+    v->count = n;
+    return v;
+  }
+  }
+
+  /* malformed, nothing has been attached to v yet and a number owns
+   * nothing either */
+  v->type = LVAL_NUM;
+  lval_del(v);
+  return NULL;
 }
 
+/* decodes one value, NULL on malformed input */
 lval*
-builtin_show(lenv *e, lval *a)
+ldec_lval(ldec *r)
 {
-  LASSERT_NUM("show", a, 1);
-  LASSERT_TYPE("show", a, 0, LVAL_STR);
-  printf("%s", a->cell[0]->sym);
+  int id = r->nobjs;
+  lval *v = ldec_value(r);
+  /* a shared value is registered before its children, it may only be
+   * referred to once they are all decoded */
+  if (v && id < r->nobjs && r->objs[id].p == v) {
+    r->objs[id].done = 1;
+  }
+  return v;
+}
+
+void
+ldec_free(ldec *r)
+{
+  free(r->objs);
+  free(r->syms);
+}
+
+lval*
+builtin_save_image(lenv *e, lval *a)
+{
+  LASSERT_NUM("save-image", a, 1);
+  LASSERT_TYPE("save-image", a, 0, LVAL_STR);
+
+  while (e->parent) {
+    e = e->parent;
+  }
+
+  lenc w = { 0 };
+  lenc_bytes(&w, LIMAGE_MAGIC, 8);
+  lenc_uint(&w, e->count);
+  for (int i = 0; i < e->count; i++) {
+    lenc_sym(&w, e->syms[i]);
+    lenc_lval(&w, e->vals[i]);
+  }
+
+  FILE *f = fopen(lstr_cstr(a->cell[0]), "wb");
+  if (!f || fwrite(w.data, 1, w.len, f) != w.len) {
+    lval *err = lval_err("save-image: cannot write '%s'", a->cell[0]->sym);
+    if (f) {
+      fclose(f);
+    }
+    lenc_free(&w);
+    lval_del(a);
+    return err;
+  }
+  fclose(f);
+  lenc_free(&w);
   lval_del(a);
   return lval_sexpr();
 }
 
+/* Restores the bindings of an image written by save-image into e. The
+ * image is mapped and decoded in a single pass, no source is read or
+ * evaluated. Bindings are decoded into a scratch env first, a corrupt
+ * image leaves e untouched. */
 lval*
-builtin_print(lenv *e, lval *a)
+lenv_load_image(lenv *e, const char *name)
 {
-  for (int i = 0; i < a->count; i++) {
-    lval_print(a->cell[0]);
-    putchar(' ');
+  lmap *map = lmap_open(name);
+  if (!map) {
+    return lval_err("%s: error: Unable to open image!", name);
+  }
+  if (map->len < 8 || memcmp(map->data, LIMAGE_MAGIC, 8) != 0) {
+    lmap_del(map);
+    return lval_err("%s: error: not an image", name);
+  }
+
+  ldec r = { map->data + 8, map->data + map->len, map };
+  lenv *img = lenv_new();
+  unsigned long count;
+  int ok = ldec_uint(&r, &count);
+  for (unsigned long i = 0; ok && i < count; i++) {
+    char *sym = ldec_sym(&r);
+    lval *v = sym ? ldec_lval(&r) : NULL;
+    if (!v) {
+      ok = 0;
+      break;
+    }
+    lenv_put_sym(img, sym, v);
+    lval_del(v);
   }
-  putchar('\n');
-  lval_del(a);
-  return lval_sexpr();
+  ok = ok && r.p == r.end;
+  for (int i = 0; ok && i < img->count; i++) {
+    lenv_put_sym(e, img->syms[i], img->vals[i]);
+  }
+  lenv_del(img);
+  ldec_free(&r);
+  lmap_del(map);
+  return ok ? lval_sexpr() : lval_err("%s: error: corrupt image", name);
 }
 
+/* A serialized record is the length of the encoded value followed by the
+ * value, records can be concatenated into a stream and split again
+ * without decoding them. */
 lval*
-builtin_error(lenv *e, lval *a)
+builtin_serialize(lenv *e, lval *a)
 {
-  LASSERT_NUM("error", a, 1);
-  LASSERT_TYPE("error", a, 0, LVAL_STR);
-  lval* err = lval_err(a->cell[0]->sym);
+  LASSERT_NUM("serialize", a, 1);
+
+  lenc body = { 0 };
+  lenc_lval(&body, a->cell[0]);
+  lenc head = { 0 };
+  lenc_uint(&head, body.len);
+
+  lval *x = new_lval(LPOOL_SEQ);
+  x->type = LVAL_STR;
+  x->slen = head.len + body.len;
+  x->sym = lalloc(x->slen + 1);
+  memcpy(x->sym, head.data, head.len);
+  memcpy(x->sym + head.len, body.data, body.len);
+  x->sym[x->slen] = 0;
+
+  lenc_free(&head);
+  lenc_free(&body);
   lval_del(a);
-  return err;
+  return x;
 }
 
+/* Decodes the record at the start of p and sets *used to its size.
+ * Returns NULL when the record is incomplete or malformed. */
 lval*
-builtin_read(lenv *e, lval *a)
+lval_deserialize(const char *p, size_t len, size_t *used)
 {
-  LASSERT_NUM("read", a, 1);
-  LASSERT_TYPE("read", a, 0, LVAL_STR);
-
-  mpc_result_t r;
-  lval* ret;
-  if (mpc_parse("<read>", a->cell[0]->sym, ParserLispy, &r)) {
-    ret = lval_read(r.output);
-    ret->type = LVAL_QEXPR;
-  } else {
-    char *error_msg = mpc_err_string(r.error);
-    mpc_err_delete(r.error);
-    ret = lval_err(error_msg);
+  ldec r = { p, p + len };
+  unsigned long n;
+  if (!ldec_uint(&r, &n) || n > (unsigned long)(r.end - r.p)) {
+    return NULL;
   }
-  lval_del(a);
-  return ret;
+  r.end = r.p + n;
+  lval *v = ldec_lval(&r);
+  if (v && r.p != r.end) {
+    lval_del(v);
+    v = NULL;
+  }
+  *used = r.end - p;
+  ldec_free(&r);
+  return v;
 }
 
 lval*
-builtin_load(lenv *e, lval *a)
+builtin_deserialize(lenv *e, lval *a)
 {
-  LASSERT_NUM("load", a, 1);
-  LASSERT_TYPE("load", a, 0, LVAL_STR);
-
-  mpc_result_t r;
-  if (mpc_parse_contents(a->cell[0]->sym, ParserLispy, &r)) {
-    lval* expr = lval_read(r.output);
-    mpc_ast_delete(r.output);
-
-    while (expr->count) {
-      lval *x = lval_eval(e, lval_pop(expr, 0));
-      if (x->type == LVAL_ERR) {
-        lval_println(x);
-      }
-      lval_del(x);
-    }
-    lval_del(a);
-    return lval_sexpr();
-  } else {
-    char *error_msg = mpc_err_string(r.error);
-    mpc_err_delete(r.error);
-    lval* err = lval_err(error_msg);
-    lval_del(a);
-    return err;
+  LASSERT_NUM("deserialize", a, 1);
+  LASSERT_TYPE("deserialize", a, 0, LVAL_STR);
+
+  size_t used;
+  char *s = lstr(a->cell[0]);
+  lval *v = lval_deserialize(s, a->cell[0]->slen, &used);
+  if (!v) {
+    v = lval_err("deserialize: malformed record");
+  } else if (used != (size_t)a->cell[0]->slen) {
+    lval_del(v);
+    v = lval_err("deserialize: trailing bytes after record");
   }
+  lval_del(a);
+  return v;
 }
 
 lval*
 lval_join(lval *a, lval *b)
 {
-  while (b->count) {
-    a = lval_add(a, lval_pop(b, 0));
+  if (!lval_append_shared(a, b->cell, b->count)) {
+    lval_reserve(a, b->count);
+  }
+  for (int i = 0; i < b->count; i++) {
+    a = lval_add(a, lval_ref(b->cell[i]));
   }
   lval_del(b);
   return a;
@@ -1179,7 +5750,7 @@ builtin_join(lenv* e, lval *a)
   for (int i = 0; i < a->count; i++) {
     LASSERT_TYPE("join", a, i, LVAL_QEXPR);
   }
-  lval *x = lval_pop(a, 0);
+  lval *x = lval_own(lval_pop(a, 0));
   while (a->count) {
     x = lval_join(x, lval_pop(a, 0));
   }
@@ -1219,8 +5790,9 @@ builtin_put(lenv *e, lval *a)
   return lval_sexpr();
 }
 
+/* picks the branch an if evaluates */
 lval*
-builtin_if(lenv *e, lval *a)
+lval_if_branch(lval *a)
 {
   LASSERT_NUM("if", a, 3);
 
@@ -1233,20 +5805,22 @@ builtin_if(lenv *e, lval *a)
     return b;
   }
   
-  lval* x;
-  if (b->num) {
-    a->cell[1]->type = LVAL_SEXPR;
-    x = lval_eval(e, lval_pop(a, 1));
-  } else {
-    a->cell[2]->type = LVAL_SEXPR;
-    x = lval_eval(e, lval_pop(a, 2));
-  }
-  
+  lval* x = lval_pop(a, b->num ? 1 : 2);
   lval_del(b);
   lval_del(a);
   return x;
 }
 
+lval*
+builtin_if(lenv *e, lval *a)
+{
+  lval* x = lval_if_branch(a);
+  if (x->type == LVAL_ERR) {
+    return x;
+  }
+  return lval_eval_sexpr(e, x);
+}
+
 lval*
 builtin_exit(lenv *e, lval *a)
 {
@@ -1257,11 +5831,113 @@ builtin_exit(lenv *e, lval *a)
 }
 
 lval*
-builtin_op(lenv* e, lval *v, const char *op)
+lval_stat(char *name, long value)
+{
+  lval *x = lval_qexpr();
+  lval_add(x, lval_sym(name));
+  lval_add(x, lval_num(value));
+  return x;
+}
+
+lval*
+builtin_alloc_stats(lenv *e, lval *a)
+{
+  /* arguments are ignored, (alloc-stats ()) */
+  lval_del(a);
+
+  long allocs = lalloc_large_allocs, frees = lalloc_large_frees, live = 0;
+  for (int i = 0; i < LALLOC_CLASSES; i++) {
+    allocs += lalloc_pools[i].allocs;
+    frees += lalloc_pools[i].frees;
+    live += (lalloc_pools[i].allocs - lalloc_pools[i].frees) * lalloc_pools[i].size;
+  }
+
+  long vallocs = 0, vfrees = 0, vbytes = 0;
+  for (int i = 0; i < LPOOL_COUNT; i++) {
+    vallocs += lval_pools[i].allocs;
+    vfrees += lval_pools[i].frees;
+    vbytes += (lval_pools[i].allocs - lval_pools[i].frees) * lval_pools[i].size;
+  }
+
+  lval *x = lval_qexpr();
+  lval_add(x, lval_stat("lval-allocs", vallocs));
+  lval_add(x, lval_stat("lval-frees", vfrees));
+  lval_add(x, lval_stat("lval-live", vallocs - vfrees));
+  lval_add(x, lval_stat("lval-bytes", vbytes));
+  lval_add(x, lval_stat("lenv-allocs", lenv_pool.allocs));
+  lval_add(x, lval_stat("lenv-frees", lenv_pool.frees));
+  lval_add(x, lval_stat("block-allocs", allocs));
+  lval_add(x, lval_stat("block-frees", frees));
+  lval_add(x, lval_stat("block-bytes", live));
+  lval_add(x, lval_stat("slab-bytes", lalloc_slab_bytes));
+  lval_add(x, lval_stat("arena-high", scratch.high));
+  lval_add(x, lval_stat("symbols", symtab.count));
+  lval_add(x, lval_stat("symbol-bytes", symtab.bytes));
+  return x;
+}
+
+lval*
+builtin_gc_stats(lenv *e, lval *a)
+{
+  lval_del(a);
+  lval *x = lval_qexpr();
+  lval_add(x, lval_stat("collections", gc.collections));
+  lval_add(x, lval_stat("objects-reclaimed", gc.objects));
+  lval_add(x, lval_stat("bytes-reclaimed", gc.bytes));
+  lval_add(x, lval_stat("last-pause-us", gc.last_pause));
+  lval_add(x, lval_stat("max-pause-us", gc.max_pause));
+  lval_add(x, lval_stat("total-pause-us", gc.total_pause));
+  lval_add(x, lval_stat("heap-objects", gc_heap_objects()));
+  lval_add(x, lval_stat("threshold", gc.threshold));
+  lval_add(x, lval_stat("next", gc.next));
+  return x;
+}
+
+/* collection is deferred to the next safe point */
+lval*
+builtin_gc(lenv *e, lval *a)
+{
+  lval_del(a);
+  gc.requested = 1;
+  return lval_sexpr();
+}
+
+lval*
+builtin_gc_threshold(lenv *e, lval *a)
+{
+  LASSERT_NUM("gc-threshold", a, 1);
+  LASSERT_TYPE("gc-threshold", a, 0, LVAL_NUM);
+  LASSERT(a, a->cell[0]->num > 0, "'gc-threshold' expects a positive number");
+  lval *x = lval_num(gc.threshold);
+  gc.threshold = a->cell[0]->num;
+  gc.next = gc.threshold;
+  lval_del(a);
+  return x;
+}
+
+/* *r = x op y for the float ops that cannot fail, 0 for the others */
+static int
+lfnum_arith(int op, double x, double y, double *r)
+{
+  switch (op) {
+  case LARITH_ADD: *r = x + y; return 1;
+  case LARITH_SUB: *r = x - y; return 1;
+  case LARITH_MUL: *r = x * y; return 1;
+  case LARITH_DIV:
+    if (y == 0) {
+      return 0;
+    }
+    *r = x / y;
+    return 1;
+  }
+  return 0;
+}
+
+lval*
+builtin_op(lenv* e, lval *v, int op)
 {
   for (int i = 0; i < v->count; i++) {
-    int type = v->cell[i]->type;
-    if (type != LVAL_NUM && type != LVAL_FNUM) {
+    if (!LVAL_IS_NUMBER(v->cell[i])) {
       lval_del(v);
       return lval_err("cannot operate on non-number!");
     }
@@ -1275,10 +5951,19 @@ builtin_op(lenv* e, lval *v, const char *op)
     return r;
   }
 
+  larith_fn f = larith_ops[op];
   while (v->count) {
     lval *y = lval_pop(v, 0);
-    // eval_op always returns a new obj, it has to be free
-    lval *r = eval_op(x, op, y);
+    /* a float operand nobody else holds takes a float result in place,
+     * so float arithmetic does not allocate at every step */
+    lval *t = x->type == LVAL_FNUM && x->ref == 1 ? x : y->type == LVAL_FNUM && y->ref == 1 ? y : NULL;
+    if (t && lfnum_arith(op, EXTRACT_FNUM(x), EXTRACT_FNUM(y), &t->fnum)) {
+      lval_del(t == x ? y : x);
+      x = t;
+      continue;
+    }
+    // f always returns a new obj, it has to be free
+    lval *r = f(x, y);
     lval_del(x);
     lval_del(y);
     
@@ -1294,25 +5979,99 @@ builtin_op(lenv* e, lval *v, const char *op)
 lval*
 builtin_add(lenv* e, lval* a)
 {
-  return builtin_op(e, a, "+");
+  return builtin_op(e, a, LARITH_ADD);
 }
 
 lval*
 builtin_sub(lenv* e, lval* a)
 {
-  return builtin_op(e, a, "-");
+  return builtin_op(e, a, LARITH_SUB);
 }
 
 lval*
 builtin_mul(lenv* e, lval* a)
 {
-  return builtin_op(e, a, "*");
+  return builtin_op(e, a, LARITH_MUL);
 }
 
 lval*
 builtin_div(lenv* e, lval* a)
 {
-  return builtin_op(e, a, "/");
+  return builtin_op(e, a, LARITH_DIV);
+}
+
+lval*
+builtin_mod(lenv* e, lval* a)
+{
+  return builtin_op(e, a, LARITH_MOD);
+}
+
+lval*
+builtin_min(lenv* e, lval* a)
+{
+  return builtin_op(e, a, LARITH_MIN);
+}
+
+lval*
+builtin_max(lenv* e, lval* a)
+{
+  return builtin_op(e, a, LARITH_MAX);
+}
+
+lval*
+builtin_pow(lenv* e, lval* a)
+{
+  return builtin_op(e, a, LARITH_POW);
+}
+
+/* Returns a copy of a lambda body with its symbols resolved to (depth,
+ * slot) addresses. Depth 0 is the call frame, where formals are bound in
+ * order, deeper ones are the local frames around the definition. Globals
+ * are left to the dynamic lookup since they may not be defined yet. The
+ * body's cells may be shared with other lists, so they are copied rather
+ * than given addresses that only hold for this lambda. */
+lval*
+lval_resolve(lval *v, lval *formals, lenv *e)
+{
+  switch (v->type) {
+  case LVAL_SYM: {
+    lval *x = lval_copy(v);
+    x->depth = 0;
+    x->slot = 0;
+    int slot = 0;
+    for (int i = 0; i < formals->count; i++) {
+      if (formals->cell[i]->sym == lsym_amp) {
+        continue;
+      }
+      if (formals->cell[i]->sym == v->sym) {
+        x->slot = slot + 1;
+        return x;
+      }
+      slot++;
+    }
+
+    int depth = 1;
+    for (lenv *f = e; f && f->parent; f = f->parent, depth++) {
+      int i = lenv_find(f, v->sym);
+      if (i >= 0) {
+        x->depth = depth;
+        x->slot = i + 1;
+        return x;
+      }
+    }
+    return x;
+  }
+  case LVAL_SEXPR:
+  case LVAL_QEXPR: {
+    lval *x = lval_reserve(lval_sexpr(), v->count);
+    x->type = v->type;
+    for (int i = 0; i < v->count; i++) {
+      lval_add(x, lval_resolve(v->cell[i], formals, e));
+    }
+    return x;
+  }
+  }
+  return lval_ref(v);
 }
 
 lval *builtin_lambda(lenv *e, lval *a)
@@ -1329,13 +6088,54 @@ lval *builtin_lambda(lenv *e, lval *a)
   lval *formals = lval_pop(a, 0);
   lval *body = lval_pop(a, 0);
   lval_del(a);
-  
-  return lval_lambda(formals, body);
+
+  lval *x = lval_resolve(body, formals, e);
+  lval_del(body);
+  return lval_lambda(formals, x);
+}
+
+/* every builtin by name, images refer to builtins this way */
+struct {
+  int count;
+  int cap;
+  char **names;
+  lbuiltin *funcs;
+} lbuiltins;
+
+char*
+lbuiltin_name(lbuiltin func)
+{
+  for (int i = 0; i < lbuiltins.count; i++) {
+    if (lbuiltins.funcs[i] == func) {
+      return lbuiltins.names[i];
+    }
+  }
+  return "";
+}
+
+lbuiltin
+lbuiltin_find(const char *name)
+{
+  for (int i = 0; i < lbuiltins.count; i++) {
+    if (strcmp(lbuiltins.names[i], name) == 0) {
+      return lbuiltins.funcs[i];
+    }
+  }
+  return NULL;
 }
 
 void
 lenv_add_builtin(lenv *e, char *name, lbuiltin func)
 {
+  if (lbuiltins.count == lbuiltins.cap) {
+    lbuiltins.cap = lbuiltins.cap ? lbuiltins.cap * 2 : 64;
+    lbuiltins.names = realloc(lbuiltins.names, sizeof(char*) * lbuiltins.cap);
+    lbuiltins.funcs = realloc(lbuiltins.funcs, sizeof(lbuiltin) * lbuiltins.cap);
+  }
+  lbuiltins.names[lbuiltins.count] = lsym_intern(name);
+  lbuiltins.funcs[lbuiltins.count] = func;
+  lbuiltins.count++;
+
   lval* k = lval_sym(name);
   lval* v = lval_func(func);
   lenv_put(e, k, v);
@@ -1357,6 +6157,11 @@ lenv_init_builtins(lenv *e) {
   lenv_add_builtin(e, "strtail", builtin_strtail);
   lenv_add_builtin(e, "strhead", builtin_strhead);
   lenv_add_builtin(e, "strjoin", builtin_strjoin);
+  lenv_add_builtin(e, "str-find", builtin_strfind);
+  lenv_add_builtin(e, "str-count", builtin_strcount);
+  lenv_add_builtin(e, "str-split", builtin_strsplit);
+  lenv_add_builtin(e, "str-replace", builtin_strreplace);
+  lenv_add_builtin(e, "str-compare", builtin_strcompare);
   
   lenv_add_builtin(e, "list", builtin_list);
   lenv_add_builtin(e, "head", builtin_head);
@@ -1366,6 +6171,27 @@ lenv_init_builtins(lenv *e) {
   lenv_add_builtin(e, "init", builtin_init);
   lenv_add_builtin(e, "len", builtin_len);
   lenv_add_builtin(e, "cons", builtin_cons);
+  lenv_add_builtin(e, "vec", builtin_vec);
+  lenv_add_builtin(e, "vec-list", builtin_vec_list);
+  lenv_add_builtin(e, "nth", builtin_nth);
+  lenv_add_builtin(e, "assoc", builtin_assoc);
+  lenv_add_builtin(e, "push", builtin_push);
+  lenv_add_builtin(e, "slice", builtin_slice);
+  lenv_add_builtin(e, "array", builtin_array);
+  lenv_add_builtin(e, "array-list", builtin_array_list);
+  lenv_add_builtin(e, "array-range", builtin_array_range);
+  lenv_add_builtin(e, "vsum", builtin_vsum);
+  lenv_add_builtin(e, "vmul", builtin_vmul);
+  lenv_add_builtin(e, "vdot", builtin_vdot);
+  lenv_add_builtin(e, "vmap+", builtin_vmap_add);
+  lenv_add_builtin(e, "vmap-", builtin_vmap_sub);
+  lenv_add_builtin(e, "vmap*", builtin_vmap_mul);
+  lenv_add_builtin(e, "hash-map", builtin_hash_map);
+  lenv_add_builtin(e, "map-get", builtin_map_get);
+  lenv_add_builtin(e, "map-has", builtin_map_has);
+  lenv_add_builtin(e, "map-put", builtin_map_put);
+  lenv_add_builtin(e, "map-del", builtin_map_del);
+  lenv_add_builtin(e, "map-keys", builtin_map_keys);
   lenv_add_builtin(e, "exit", builtin_exit);
   lenv_add_builtin(e, "def", builtin_def);
   lenv_add_builtin(e, "if", builtin_if);
@@ -1377,6 +6203,10 @@ lenv_init_builtins(lenv *e) {
   lenv_add_builtin(e, "-", builtin_sub);
   lenv_add_builtin(e, "*", builtin_mul);
   lenv_add_builtin(e, "/", builtin_div);
+  lenv_add_builtin(e, "%", builtin_mod);
+  lenv_add_builtin(e, "min", builtin_min);
+  lenv_add_builtin(e, "max", builtin_max);
+  lenv_add_builtin(e, "^", builtin_pow);
 
   lenv_add_builtin(e, ">", builtin_gt);
   lenv_add_builtin(e, ">=", builtin_gte);
@@ -1390,46 +6220,254 @@ lenv_init_builtins(lenv *e) {
   lenv_add_builtin(e, "!", builtin_not);
 
   lenv_add_builtin(e, "load", builtin_load);
+  lenv_add_builtin(e, "load-data", builtin_load_data);
+  lenv_add_builtin(e, "save-image", builtin_save_image);
+  lenv_add_builtin(e, "serialize", builtin_serialize);
+  lenv_add_builtin(e, "deserialize", builtin_deserialize);
   lenv_add_builtin(e, "print", builtin_print);
   lenv_add_builtin(e, "show", builtin_show);  
   lenv_add_builtin(e, "error", builtin_error);
+  lenv_add_builtin(e, "alloc-stats", builtin_alloc_stats);
+  lenv_add_builtin(e, "gc", builtin_gc);
+  lenv_add_builtin(e, "gc-stats", builtin_gc_stats);
+  lenv_add_builtin(e, "gc-threshold", builtin_gc_threshold);
   
   lenv_add_builtin_value(e, "false", lval_bool(0));
   lenv_add_builtin_value(e, "true", lval_bool(1));
 }
 
-lval*
-lval_eval_sexpr(lenv *e, lval *v)
+
+void
+lcode_emit(lcode *c, unsigned ins)
 {
-  for (int i = 0; i < v->count; i++) {
-    v->cell[i] = lval_eval(e, v->cell[i]);
+  if (c->count == c->cap) {
+    int cap = c->cap ? c->cap * 2 : 8;
+    c->ins = lrealloc(c->ins, sizeof(unsigned) * c->cap, sizeof(unsigned) * cap);
+    c->cap = cap;
+  }
+  c->ins[c->count++] = ins;
+}
+
+int
+lcode_const(lcode *c, lval *v)
+{
+  if (c->nconsts == c->cconsts) {
+    int cap = c->cconsts ? c->cconsts * 2 : 8;
+    c->consts = lrealloc(c->consts, sizeof(lval*) * c->cconsts, sizeof(lval*) * cap);
+    c->cconsts = cap;
   }
+  c->consts[c->nconsts] = v;
+  return c->nconsts++;
+}
 
+/* nested S-Expressions are flattened into the same stream, depth is the
+ * stack height before v starts pushing its cells */
+void
+lcode_compile_list(lcode *c, lval *v, int depth)
+{
   for (int i = 0; i < v->count; i++) {
-    if (v->cell[i]->type == LVAL_ERR) {
-      return lval_take(v, i);
+    lval *x = v->cell[i];
+    if (x->type == LVAL_SEXPR) {
+      lcode_compile_list(c, x, depth + i);
+      continue;
+    }
+    lcode_emit(c, LOP(x->type == LVAL_SYM ? LOP_LOOKUP : LOP_CONST, lcode_const(c, x)));
+    if (depth + i + 1 > c->stack) {
+      c->stack = depth + i + 1;
     }
   }
+  lcode_emit(c, LOP(LOP_APPLY, v->count));
+  if (depth + 1 > c->stack) {
+    c->stack = depth + 1;
+  }
+}
 
-  if (v->count == 0) {
-    return v;
+lcode*
+lcode_compile(lval *v)
+{
+  lcode *c = lalloc(sizeof(lcode));
+  bzero(c, sizeof(lcode));
+  lcode_compile_list(c, v, 0);
+  return c;
+}
+
+/* runs compiled code, the final application is left to the caller so
+ * that it happens in tail position */
+lval*
+lvm_run(lenv *e, lcode *c)
+{
+  lval *small[32];
+  lval **stack = c->stack <= 32 ? small : malloc(sizeof(lval*) * c->stack);
+  int sp = 0;
+
+  for (int pc = 0; pc < c->count; pc++) {
+    unsigned ins = c->ins[pc];
+    switch (ins & 0xff) {
+    case LOP_CONST:
+      stack[sp++] = lval_ref(c->consts[ins >> 8]);
+      break;
+    case LOP_LOOKUP:
+      stack[sp++] = lenv_get(e, c->consts[ins >> 8]);
+      break;
+    case LOP_APPLY: {
+      int n = ins >> 8;
+      lval *args = lval_reserve(lval_sexpr(), n);
+      for (int i = sp - n; i < sp; i++) {
+        lval_add(args, stack[i]);
+      }
+      sp -= n;
+      stack[sp++] = pc == c->count - 1 ? args : lval_apply(e, args);
+      break;
+    }
+    }
   }
 
-  if (v->count == 1) {
-    return lval_take(v, 0);
+  lval *x = sp ? stack[sp - 1] : lval_sexpr();
+  if (stack != small) {
+    free(stack);
   }
+  return x;
+}
 
-  lval *f = lval_pop(v, 0);
-  if (f->type != LVAL_FUNC) {
-    int type = f->type;
-    lval_del(f);
+/* evaluates the cells of any list, leaving an S-Expression to apply */
+lval*
+lval_eval_args(lenv *e, lval *v)
+{
+  if (lvm_enabled) {
+    if (!v->code) {
+      v->code = lcode_compile(v);
+    }
+    lval *x = lvm_run(e, v->code);
     lval_del(v);
-    return lval_err("S-Expression starts with incorrect type. Got: %s, Expected: %s.", ltype_name(type), ltype_name(LVAL_FUNC));
+    return x;
+  }
+
+  v = lval_own(v);
+  lval_uncache(v);
+  lval_cells_own(v);
+  v->type = LVAL_SEXPR;
+  for (int i = 0; i < v->count; i++) {
+    v->cell[i] = lval_eval(e, v->cell[i]);
+  }
+  return v;
+}
+
+/* Applies an S-Expression whose cells are already evaluated. Calls in
+ * tail position (a lambda body, the branch of an if, the argument of
+ * eval) continue this loop rather than recursing, so tail calls run in
+ * constant C stack.
+ *
+ * With dynamic scoping the callee of a tail call still sees the caller's
+ * frame. Instead of chaining the frames, the bindings the callee does not
+ * shadow are copied into its frame and the caller's frame is dropped, a
+ * lambda calling itself simply rebinds its frame. Either way memory stays
+ * bounded by the number of distinct names. */
+lval*
+lval_apply(lenv *e, lval *v)
+{
+  /* activation frame of the lambda whose body is being run, e == frame */
+  lenv *frame = NULL;
+  lval *body = NULL;
+  lval *r = NULL;
+
+  gc.depth++;
+  while (!r) {
+    for (int i = 0; i < v->count; i++) {
+      if (v->cell[i]->type == LVAL_ERR) {
+        r = lval_take(v, i);
+        break;
+      }
+    }
+    if (r) {
+      break;
+    }
+
+    if (v->count == 0) {
+      r = v;
+      break;
+    }
+
+    if (v->count == 1) {
+      r = lval_take(v, 0);
+      break;
+    }
+
+    lval *f = lval_pop(v, 0);
+    if (f->type != LVAL_FUNC) {
+      int type = f->type;
+      lval_del(f);
+      lval_del(v);
+      r = lval_err("S-Expression starts with incorrect type. Got: %s, Expected: %s.", ltype_name(type), ltype_name(LVAL_FUNC));
+      break;
+    }
+
+    if (f->func == builtin_if) {
+      lval_del(f);
+      lval *x = lval_if_branch(v);
+      if (x->type == LVAL_ERR) {
+        r = x;
+      } else {
+        v = lval_eval_args(e, x);
+      }
+      continue;
+    }
+
+    if (f->func == builtin_eval && v->count == 1 && v->cell[0]->type == LVAL_QEXPR) {
+      lval_del(f);
+      v = lval_eval_args(e, lval_take(v, 0));
+      continue;
+    }
+
+    if (f->func) {
+      r = f->func(e, v);
+      lval_del(f);
+      break;
+    }
+
+    lenv *act = lval_bind(e, f, v, &r);
+    if (!act) {
+      lval_del(f);
+      break;
+    }
+
+    if (frame && f->body == body) {
+      for (int i = 0; i < act->count; i++) {
+        lenv_put_sym(frame, act->syms[i], act->vals[i]);
+      }
+      lenv_del(act);
+    } else {
+      if (frame) {
+        for (int i = 0; i < frame->count; i++) {
+          if (lenv_find(act, frame->syms[i]) < 0) {
+            lenv_put_sym(act, frame->syms[i], frame->vals[i]);
+          }
+        }
+        lenv *caller = act->parent;
+        act->parent = frame->parent ? lenv_ref(frame->parent) : NULL;
+        lenv_del(caller);
+        lenv_del(frame);
+        lval_del(body);
+      }
+      frame = act;
+      body = lval_ref(f->body);
+      e = act;
+    }
+    lval_del(f);
+    v = lval_eval_args(e, lval_ref(body));
   }
 
-  lval* result = lval_call(e, f, v);
-  lval_del(f); 
-  return result;
+  if (frame) {
+    lenv_del(frame);
+    lval_del(body);
+  }
+  gc.depth--;
+  return r;
+}
+
+lval*
+lval_eval_sexpr(lenv *e, lval *v)
+{
+  return lval_apply(e, lval_eval_args(e, v));
 }
 
 lval*
@@ -1452,6 +6490,9 @@ main(int argc, char **argv)
 {
   puts("Lispy Version 0.0.0.0.0.1");
   puts("Press Ctrl+c to exit\n");
+  lalloc_init();
+  lval_init_static();
+  lsym_amp = lsym_intern("&");
   
   ParserNumber  = mpc_new("number");
   ParserFnumber = mpc_new("fnumber");
@@ -1470,7 +6511,7 @@ main(int argc, char **argv)
       fnumber  : /-?[0-9]+\\.[0-9]+/ ;                                      \
       string   : /\"(\\\\.|[^\"])*\"/ ;                                     \
       comment  : /;[^\\r\\n]*/ ;                                            \
-      symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/;                          \
+      symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&%^]+/;                        \
       sexpr    : '(' <expr>* ')' ;                                          \
       qexpr    : '{' <expr>* '}' ;                                          \
       expr     : <fnumber> | <number> | <string> | <comment> |              \
@@ -1480,9 +6521,28 @@ main(int argc, char **argv)
 
   lenv *env = lenv_new();
   lenv_init_builtins(env);
+  gc.global = env;
 
   if (argc >= 2) {
     for (int i = 1; i < argc; i++) {
+      /* evaluate through the bytecode VM instead of walking the tree */
+      if (strcmp(argv[i], "--vm") == 0) {
+        lvm_enabled = 1;
+        continue;
+      }
+      if (strcmp(argv[i], "--mpc") == 0) {
+        lmpc_enabled = 1;
+        continue;
+      }
+      /* restore the bindings saved by save-image */
+      if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+        lval *x = lenv_load_image(env, argv[++i]);
+        if (x->type == LVAL_ERR) {
+          lval_println(x);
+        }
+        lval_del(x);
+        continue;
+      }
       lval *args = lval_add(lval_sexpr(), lval_str(argv[i]));
       lval* x = builtin_load(env, args);
       if (x->type == LVAL_ERR) {
@@ -1500,19 +6560,34 @@ main(int argc, char **argv)
     }
     add_history(input);
 
-    mpc_result_t r;
-    if (mpc_parse("<stdin>", input, ParserLispy, &r)) {
+    lval *x;
+    if (lmpc_enabled) {
+      mpc_result_t r;
+      if (!mpc_parse("<stdin>", input, ParserLispy, &r)) {
+        mpc_err_print(r.error);
+        mpc_err_delete(r.error);
+        free(input);
+        continue;
+      }
       // mpc_ast_print(r.output);
-      lval *x = lval_read(r.output);
-      lval_println(x);      
-      lval *v = lval_eval(env, x);
-      lval_println(v);
-      lval_del(v);
+      x = lval_read(r.output);
       mpc_ast_delete(r.output);
     } else {
-      mpc_err_print(r.error);
-      mpc_err_delete(r.error);
+      x = lread_all("<stdin>", input, strlen(input));
+      if (x->type == LVAL_ERR) {
+        puts(x->err);
+        lval_del(x);
+        free(input);
+        continue;
+      }
     }
+
+    lval_println(x);      
+    lval *v = lval_eval(env, x);
+    lval_println(v);
+    lval_del(v);
+    larena_reset(&scratch);
+    gc_safe_point();
     free(input);
   }
 
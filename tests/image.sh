@@ -0,0 +1,43 @@
+#!/bin/sh
+# Saves an image and starts from it again, then loads hand made images
+# that are corrupt: each has to be refused as a whole, without crashing
+# and without leaving any of its bindings behind.
+#
+#   tests/image.sh <lispy> [flags...]
+lispy=$1
+shift
+dir=$(dirname "$0")
+tmp=${TMPDIR:-/tmp}/lispy-image.$$
+
+run() {
+  "$lispy" "$@" | sed -e '1,3d' -e 's/^\(lispy> \)*//' -e "s#$tmp#TMP#g"
+}
+
+{
+  printf '%s\n' '(def {sq} (\ {x} {* x x}))'
+  printf '%s\n' '(def {add2} ((\ {a b} {+ a b}) 2))'
+  printf '%s\n' '(def {data} (list 1 2.5 "str" {a b} (vec {1 2}) (hash-map {1 2}) (^ 2 100)))'
+  printf '(save-image "%s")\n' "$tmp.img"
+} | run "$@" "$dir/prelude.lspy" > /dev/null
+printf '(sq 12)\n(add2 40)\ndata\n(map sq {1 2 3})\n' | run "$@" --image "$tmp.img" > "$tmp.out"
+
+# a symbol whose slot does not fit an int
+printf 'LSPYIMG1\001\000\001f\000\006\005\001\003\000\001y\000\000\001\005\001\003\000\001x\000\000\201\200\200\200\010\042' > "$tmp.slot"
+# a partial application whose env is its own parent
+printf 'LSPYIMG1\001\000\001g\000\006\005\000\005\000\241\000\040\000' > "$tmp.cycle"
+# a list that contains itself
+printf 'LSPYIMG1\001\000\001l\000\205\001\040\000' > "$tmp.self"
+# a lambda with a number for formals
+printf 'LSPYIMG1\001\000\001h\000\006\000\002\005\000\042' > "$tmp.formals"
+# a good binding followed by a bad one
+printf 'LSPYIMG1\002\000\001a\000\000\002\000\001b\000\143' > "$tmp.half"
+# trailing bytes
+printf 'LSPYIMG1\001\000\001a\000\000\002\000' > "$tmp.trail"
+for img in slot cycle self formals half trail; do
+  printf '(f 1)\n(g 1)\nl\n(h 1)\na\n' | run "$@" --image "$tmp.$img" >> "$tmp.out"
+done
+
+diff -u "$dir/image.out" "$tmp.out"
+status=$?
+rm -f "$tmp.img" "$tmp.out" "$tmp.slot" "$tmp.cycle" "$tmp.self" "$tmp.formals" "$tmp.half" "$tmp.trail"
+exit $status
@@ -0,0 +1,14 @@
+#!/bin/sh
+# Feeds a test case to the REPL, one form per line, after loading the
+# prelude and compares what it prints with the .out file next to it.
+#
+#   tests/run.sh <lispy> <case.lspy> [flags...]
+#
+# Prompts are dropped since editline may or may not print them when stdin
+# is not a terminal.
+lispy=$1
+case=$2
+shift 2
+dir=$(dirname "$0")
+
+"$lispy" "$@" "$dir/prelude.lspy" < "$case" | sed 's/^\(lispy> \)*//' | diff -u "${case%.lspy}.out" -
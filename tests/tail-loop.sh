@@ -0,0 +1,23 @@
+#!/bin/sh
+# Runs a tail-recursive loop of 10 million iterations, and shorter ones
+# through mutual recursion and eval, with a 256KB C stack and a 256MB
+# address space. Recursing in C or keeping a frame per iteration runs out
+# of one or the other long before the end.
+#
+#   tests/tail-loop.sh <lispy> [flags...]
+lispy=$1
+shift
+dir=$(dirname "$0")
+
+ulimit -s 256 || exit 1
+ulimit -v 262144 || exit 1
+
+"$lispy" "$@" "$dir/prelude.lspy" <<'EOF' | sed 's/^\(lispy> \)*//' | diff -u "$dir/tail-loop.out" -
+(fun {count n acc} {if (== n 0) {acc} {count (- n 1) (+ acc 1)}})
+(count 10000000 0)
+(fun {ping n} {if (== n 0) {"ping"} {pong (- n 1)}})
+(fun {pong n} {if (== n 0) {"pong"} {ping (- n 1)}})
+(ping 1000001)
+(fun {down n} {if (== n 0) {0} {eval {down (- n 1)}}})
+(down 1000000)
+EOF
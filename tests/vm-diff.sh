@@ -0,0 +1,21 @@
+#!/bin/sh
+# Differential test of the bytecode VM: runs every case given through the
+# tree walker and through --vm and fails if the output differs at all.
+#
+#   tests/vm-diff.sh <lispy> <case.lspy>...
+lispy=$1
+shift
+dir=$(dirname "$0")
+tmp=${TMPDIR:-/tmp}/lispy-vm-diff.$$
+status=0
+
+for case in "$@"; do
+  "$lispy" "$dir/prelude.lspy" < "$case" > "$tmp.tree" 2>&1
+  "$lispy" --vm "$dir/prelude.lspy" < "$case" > "$tmp.vm" 2>&1
+  if ! diff -u --label "$case" --label "$case --vm" "$tmp.tree" "$tmp.vm"; then
+    status=1
+  fi
+done
+
+rm -f "$tmp.tree" "$tmp.vm"
+exit $status